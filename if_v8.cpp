@@ -5,11 +5,28 @@
  * Last Change: 2014-11-02
  * Maintainer: Yukihiro Nakadaira <yukihiro.nakadaira@gmail.com>
  */
+#include <cctype>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <map>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <sys/stat.h>
+#ifdef WIN32
+# include <stdlib.h>
+# include <process.h>
+# define getpid _getpid
+#else
+# include <climits>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/time.h>
+# include <unistd.h>
+#endif
 #include <v8.h>
 #include <libplatform/libplatform.h>
 
@@ -19,57 +36,129 @@
 extern "C" {
 DLLEXPORT const char *init(const char *args);
 DLLEXPORT const char *execute(const char *expr);
+DLLEXPORT const char *evaluate(const char *expr);
+DLLEXPORT const char *idle(const char *arg);
 }
 
 using namespace v8;
 
-template<typename T, typename U>
-class PairTable {
+// Hash table with separate chaining.  Entries are kept in a deque and
+// removed slots are recycled through a free list, so del() never shifts
+// other entries and a pointer returned by get() stays valid until that key
+// is deleted.  H is a functor that returns the hash of a key.
+template<typename T, typename U, typename H>
+class HashTable {
 public:
-  typedef std::vector<std::pair<T, U> > container_type;
-  typedef typename container_type::value_type value_type;
-  typedef typename container_type::iterator iterator;
-
-  PairTable() {}
-  iterator begin() { return _container.begin(); }
-  iterator end() { return _container.end(); }
-
-  iterator get(const T& key) {
-    for (iterator it = _container.begin(); it != _container.end(); ++it) {
-      if (it->first == key)
-        return it;
+  HashTable() : _size(0), _free(-1) { _buckets.resize(16, -1); }
+
+  size_t size() const { return _size; }
+
+  U *get(const T& key) {
+    size_t hash = _hasher(key);
+    for (int i = _buckets[hash & (_buckets.size() - 1)]; i != -1; i = _entries[i].next) {
+      if (_entries[i].hash == hash && _entries[i].key == key)
+        return &_entries[i].value;
     }
-    return end();
+    return NULL;
   }
 
-  void set(const T& key, const U& value) {
-    iterator it = get(key);
-    if (it != end())
-      it->second = value;
-    else
-      _container.push_back(value_type(key, value));
+  U *set(const T& key, const U& value) {
+    U *p = get(key);
+    if (p != NULL) {
+      *p = value;
+      return p;
+    }
+    if (_size >= _buckets.size())
+      rehash(_buckets.size() * 2);
+    int i;
+    if (_free != -1) {
+      i = _free;
+      _free = _entries[i].next;
+    } else {
+      i = (int)_entries.size();
+      _entries.push_back(Entry());
+    }
+    Entry& e = _entries[i];
+    e.key = key;
+    e.value = value;
+    e.hash = _hasher(key);
+    e.used = true;
+    e.next = _buckets[e.hash & (_buckets.size() - 1)];
+    _buckets[e.hash & (_buckets.size() - 1)] = i;
+    ++_size;
+    return &e.value;
   }
 
   void del(const T& key) {
-    iterator it = get(key);
-    if (it != end())
-      _container.erase(it);
+    size_t hash = _hasher(key);
+    int *link = &_buckets[hash & (_buckets.size() - 1)];
+    for (int i = *link; i != -1; link = &_entries[i].next, i = *link) {
+      Entry& e = _entries[i];
+      if (e.hash == hash && e.key == key) {
+        *link = e.next;
+        e.key = T();
+        e.value = U();
+        e.used = false;
+        e.next = _free;
+        _free = i;
+        --_size;
+        return;
+      }
+    }
+  }
+
+  void clear() {
+    // assign empty values first, this resets a Persistent
+    for (int i = 0; i < (int)_entries.size(); ++i) {
+      _entries[i].key = T();
+      _entries[i].value = U();
+    }
+    _entries.clear();
+    _buckets.assign(16, -1);
+    _size = 0;
+    _free = -1;
   }
 
 private:
-  container_type _container;
+  struct Entry {
+    Entry() : hash(0), next(-1), used(false) {}
+    T key;
+    U value;
+    size_t hash;
+    int next;
+    bool used;
+  };
+
+  void rehash(size_t nbuckets) {
+    _buckets.assign(nbuckets, -1);
+    for (int i = 0; i < (int)_entries.size(); ++i) {
+      Entry& e = _entries[i];
+      if (!e.used)
+        continue;
+      e.next = _buckets[e.hash & (nbuckets - 1)];
+      _buckets[e.hash & (nbuckets - 1)] = i;
+    }
+  }
+
+  std::deque<Entry> _entries;
+  std::vector<int> _buckets;
+  size_t _size;
+  int _free;
+  H _hasher;
 };
 
 struct VimValue {
-  VimValue(char_u *val) { v_type = VAR_FUNC; vval.v_string = val; }
-  VimValue(list_T *val) { v_type = VAR_LIST; vval.v_list = val; }
-  VimValue(dict_T *val) { v_type = VAR_DICT; vval.v_dict = val; }
+  VimValue() { v_type = VAR_UNKNOWN; vval.v_string = NULL; hash = 0; }
+  VimValue(char_u *val) { v_type = VAR_FUNC; vval.v_string = val; hash = (val == NULL) ? 0 : str_hash(val); }
+  VimValue(list_T *val) { v_type = VAR_LIST; vval.v_list = val; hash = ptr_hash(val); }
+  VimValue(dict_T *val) { v_type = VAR_DICT; vval.v_dict = val; hash = ptr_hash(val); }
   bool operator==(const VimValue& other) const {
-    if (v_type != other.v_type)
+    if (v_type != other.v_type || hash != other.hash)
       return false;
     else if (v_type == VAR_FUNC) {
       if (vval.v_string != NULL && other.vval.v_string != NULL)
-        return strcmp((char*)vval.v_string, (char*)other.vval.v_string) == 0;
+        return vval.v_string == other.vval.v_string
+          || strcmp((char*)vval.v_string, (char*)other.vval.v_string) == 0;
       return vval.v_string == other.vval.v_string;
     } else if (v_type == VAR_LIST)
       return vval.v_list == other.vval.v_list;
@@ -77,7 +166,20 @@ struct VimValue {
       return vval.v_dict == other.vval.v_dict;
     return false;
   }
+  // same as hash_hash() in Vim
+  static size_t str_hash(char_u *key) {
+    size_t h = *key;
+    if (h != 0)
+      while (*++key != 0)
+        h = h * 101 + *key;
+    return h;
+  }
+  static size_t ptr_hash(void *p) {
+    size_t h = (size_t)p;
+    return h ^ (h >> 4) ^ (h >> 12);
+  }
   char v_type;
+  size_t hash;  // computed once, so a funcref name is hashed only on creation
   union {
     char_u *v_string;
     list_T *v_list;
@@ -87,8 +189,39 @@ struct VimValue {
 
 typedef Persistent<Value, CopyablePersistentTraits<Value> > CopyableValuePersistent;
 
-typedef PairTable<Handle<Value>, VimValue> V8ToVimLookup;
-typedef PairTable<VimValue, CopyableValuePersistent> VimToV8Lookup;
+// Hash of a JavaScript Array/Object.  Handles are compared only when the
+// identity hashes collide.
+struct V8ObjectHash {
+  size_t operator()(const Handle<Value>& v) const {
+    return (size_t)Handle<Object>::Cast(v)->GetIdentityHash();
+  }
+};
+
+typedef HashTable<Handle<Value>, VimValue, V8ObjectHash> V8ToVimLookup;
+struct VimValueHash {
+  size_t operator()(const VimValue& v) const { return v.hash; }
+};
+
+typedef HashTable<VimValue, CopyableValuePersistent, VimValueHash> VimToV8Lookup;
+typedef HashTable<VimValue, Handle<Value>, VimValueHash> VimToV8CopyLookup;
+
+// Key of a Vim hashtable with its hash_hash() value.
+struct HashKey {
+  HashKey() : hash(0), str(NULL) {}
+  HashKey(hash_T h, const char *s) : hash(h), str(s) {}
+  bool operator==(const HashKey& other) const {
+    return str == other.str || (str != NULL && other.str != NULL && strcmp(str, other.str) == 0);
+  }
+  hash_T hash;
+  const char *str;
+};
+
+struct HashKeyHash {
+  size_t operator()(const HashKey& k) const { return k.hash; }
+};
+
+typedef Persistent<String, CopyablePersistentTraits<String> > CopyableStringPersistent;
+typedef HashTable<HashKey, CopyableStringPersistent, HashKeyHash> InternTable;
 
 static void *dll_handle = NULL;
 static Isolate *isolate;
@@ -96,6 +229,7 @@ static Persistent<Context> p_context;
 static Persistent<FunctionTemplate> p_VimList;
 static Persistent<FunctionTemplate> p_VimDict;
 static Persistent<FunctionTemplate> p_VimFunc;
+static Persistent<FunctionTemplate> p_VimListIter;
 
 // ensure the following condition:
 //   var x = new vim.Dict();
@@ -104,43 +238,338 @@ static Persistent<FunctionTemplate> p_VimFunc;
 // the same List/Dictionary is instantiated by only one V8 object.
 static VimToV8Lookup objcache;
 
+// Vim hashtable key -> internalized V8 string, so that for..in over a
+// VimDict and copying a Dictionary do not create key strings again.  The
+// keys are owned by intern_keys.  Emptied when it grows too large.
+#define INTERN_MAX 4096
+static InternTable interned;
+static std::vector<char *> intern_keys;
+
+// Recently used property names of VimDict.  A property name is usually an
+// internalized string, so the same name is the same handle and is found
+// by comparing handles, without encoding it to UTF-8 and hashing it again.
+// A computed name is a new handle each time and is found by comparing
+// contents.  A name enters the cache only when it misses a second time, so
+// that names used once, e.g. walking many keys, do not make a global
+// handle each; until then it is converted into dictkey_scratch.
+struct DictKey {
+  Persistent<String> name;
+  int length;
+  std::string key;
+  hash_T hash;
+};
+#define DICTKEY_CACHE_SIZE 16
+#define DICTKEY_SEEN_SIZE 64
+static DictKey dictkey_cache[DICTKEY_CACHE_SIZE];
+static DictKey dictkey_scratch;
+static hash_T dictkey_seen[DICTKEY_SEEN_SIZE];
+static int dictkey_next = 0;
+
+// if_v8 options given to init(), each on its own line so that a value may
+// contain spaces, or with the V8 flags, where they are removed before the
+// flags are passed to V8.
+//   --if_v8_code_cache=DIR   keep code cache of load()ed files in DIR
+//   --if_v8_mmap=1           map large load()ed files instead of reading
+//                            them; they must not be rewritten in place
+//   --if_v8_idle_budget=MS   time idle() may spend for GC (default 10)
+//   --if_v8_idle_threshold=KB
+//                            allocation since the last GC below which
+//                            idle() does nothing (default 1024)
+//   --if_v8_max_old_space=MB, --if_v8_max_semi_space=MB
+//                            heap limits of the isolate
+//   --if_v8_heap_soft_limit=MB
+//                            heap size after GC at which a running script
+//                            is terminated (default 90% of the limit)
+struct Options {
+  Options() : mmap(false), idle_budget(10), idle_threshold(1024 * 1024),
+    max_old_space(0), max_semi_space(0), heap_soft_limit(0) {}
+  std::string code_cache_dir;
+  bool mmap;
+  int idle_budget;
+  size_t idle_threshold;
+  int max_old_space;
+  int max_semi_space;
+  size_t heap_soft_limit;
+};
+static Options options;
+
+// Number of execute()/evaluate() calls and preloaded files running
+// JavaScript (load() and require() run inside one of them), and whether the
+// running script was terminated for exceeding heap_soft_limit.  V8 aborts
+// the process when the heap limit is hit, so we stop the script first.
+static int script_running = 0;
+static bool heap_limit_terminated = false;
+#define HEAP_LIMIT_MSG "heap limit reached, script terminated"
+
+// Heap size after the last GC, to measure allocation since then.
+static size_t heap_used_after_gc = 0;
+// Number of values pinned by live wrappers after the last GC.
+static int pinned_after_gc = 0;
+static unsigned long idle_gc = 0;
+static unsigned long idle_skipped = 0;
+
+// How ExecuteString() compiles a script.
+//   CODE_CACHE:   on disk code cache for load()
+// execute() uses the in memory cache of CompileCached() instead.
+enum CacheMode { NO_CACHE, CODE_CACHE };
+
+static unsigned long code_cache_hits = 0;
+static unsigned long code_cache_misses = 0;
+
+// Compiled scripts of execute(), so that a mapping or autocmd running the
+// same :V8 command again does not compile it again.  Least recently used
+// entry is replaced.
+struct ScriptCacheEntry {
+  ScriptCacheEntry() : hash(0), last_used(0) {}
+  size_t hash;
+  std::string source;
+  std::string name;
+  Persistent<UnboundScript> script;
+  unsigned long last_used;
+};
+#define SCRIPT_CACHE_SIZE 64
+static ScriptCacheEntry script_cache[SCRIPT_CACHE_SIZE];
+static unsigned long script_cache_clock = 0;
+static unsigned long script_cache_hits = 0;
+static unsigned long script_cache_misses = 0;
+
+// Modules loaded by require(), by canonical path.  A module is loaded
+// again when the modification time or size of its file changed.
+struct Module {
+  CopyableValuePersistent module;
+  time_t mtime;
+  off_t size;
+};
+static std::map<std::string, Module> modules;
+
 // register
 static dict_T *v_reg;
 
-// reg['%v8_weak%']
-// keep reference to avoid garbage collect.
-static dict_T *v_weak;
+// reg['%v8_pinned%']
+// Values referenced from V8.  Each wrapper owns one item of this list.  The
+// item holds a reference count and keeps the value reachable for Vim's
+// garbage collector.  pin() and unpin() are O(1) list operations.
+static list_T *v_pinned;
+
+// Incremented whenever Vim code may have run, i.e. whenever a List may
+// have been changed behind our back.
+static unsigned int vim_generation = 0;
+
+// Side index of a List for O(1) indexed access from a VimList wrapper.
+// It is valid only in the generation it was built in.  It is built on the
+// second indexed access within a generation, so code that interleaves Vim
+// calls and single accesses keeps using list_find() instead of rebuilding
+// the index every time.
+struct VimListIndex {
+  VimListIndex() : generation(0), len(0), accesses(0), built(false) {}
+  unsigned int generation;
+  int len;
+  int accesses;
+  bool built;
+  std::vector<listitem_T*> items;
+};
+
+// Free lists for the bookkeeping of wrappers, so that creating and
+// collecting many wrappers does not call malloc() and free() for each.
+//   pin_pool:   items of the pinned list, allocated by Vim
+//   index_pool: VimListIndex, with the capacity of "items" kept if small
+#define PIN_POOL_MAX 4096
+#define INDEX_POOL_MAX 256
+#define INDEX_POOL_ITEMS_MAX 4096
+static std::vector<listitem_T *> pin_pool;
+static std::vector<VimListIndex *> index_pool;
+static unsigned long pool_hits = 0;
+static unsigned long pool_misses = 0;
+
+// Pinned values of collected wrappers.  Weak callbacks only queue them, so
+// that a large GC does not free Vim values inside the pause.  execute() and
+// evaluate() release a quarter of the queue, at least RELEASE_BATCH and at
+// most RELEASE_BATCH_MAX, so that each call does bounded work.  idle()
+// releases all it can in its time budget.
+#define RELEASE_BATCH 1024
+#define RELEASE_BATCH_MAX 16384
+static std::vector<listitem_T *> release_queue;
+static unsigned long released = 0;
+
+// State of a VimList iterator.  Vim advances the watcher when the item it
+// points to is removed from the List.
+struct VimListIter {
+  listwatch_T lw;
+  typval_T tv;      // reference to the List while iterating
+  bool done;
+  Persistent<Object> handle;
+};
+
+// Backing store of an ArrayBuffer made from a List.  Freed when the
+// ArrayBuffer is collected.
+struct ExternalBuffer {
+  void *data;
+  size_t length;
+  Persistent<ArrayBuffer> handle;
+};
+
+class ArrayBufferAllocator : public ArrayBuffer::Allocator {
+public:
+  virtual void *Allocate(size_t length) { return calloc(length, 1); }
+  virtual void *AllocateUninitialized(size_t length) { return malloc(length); }
+  virtual void Free(void *data, size_t length) { free(data); }
+};
+
+static ArrayBufferAllocator array_buffer_allocator;
+
+// ASCII strings of at least this many bytes are passed to V8 as external
+// strings, which V8 neither copies into its heap nor decodes.
+#define EXTERNAL_STRING_MIN 4096
+
+// Copy of a Vim string owned by an external V8 string.  Vim strings are
+// not reference counted and may be freed while JavaScript still holds the
+// string, so the bytes are copied once with memcpy().
+class VimStringResource : public String::ExternalOneByteStringResource {
+public:
+  VimStringResource(char *data, size_t length) : _data(data), _length(length) {
+    isolate->AdjustAmountOfExternalAllocatedMemory(_length);
+  }
+  virtual ~VimStringResource() {
+    isolate->AdjustAmountOfExternalAllocatedMemory(-(int64_t)_length);
+    free(_data);
+  }
+  virtual const char *data() const { return _data; }
+  virtual size_t length() const { return _length; }
+private:
+  char *_data;
+  size_t _length;
+};
+
+// Strings of List and Dictionary items passed to V8, so that reading the
+// same large item again does not copy it again.  An entry is keyed on the
+// item and its string and is valid only while neither Vim code nor a
+// wrapper setter has run since it was made, since either may free the item
+// and reuse its memory.  The handle is weak and does not keep the string
+// alive.
+#define STRING_CACHE_SIZE 16
+struct StringCacheEntry {
+  StringCacheEntry() : item(NULL), str(NULL), generation(0), string_generation(0) {}
+  const void *item;
+  char_u *str;
+  unsigned int generation;
+  unsigned int string_generation;
+  Persistent<String> handle;
+};
+static StringCacheEntry string_cache[STRING_CACHE_SIZE];
+// Incremented by wrapper setters and whenever pinned values are released.
+static unsigned int string_generation = 0;
+
+#ifndef WIN32
+// A script file mapped into memory, used as the source of an external
+// string.  The mapping lives as long as the string.
+class MappedFileResource : public String::ExternalOneByteStringResource {
+public:
+  MappedFileResource(void *addr, size_t length) : _addr(addr), _length(length) {}
+  virtual ~MappedFileResource() {
+    munmap(_addr, _length);
+  }
+  virtual const char *data() const { return static_cast<const char *>(_addr); }
+  virtual size_t length() const { return _length; }
+private:
+  void *_addr;
+  size_t _length;
+};
+#endif
 
 static const char *init_v8(std::string args);
 
+static Handle<String> InternKey(char_u *key, hash_T hash);
+static DictKey *LookupDictKey(Handle<String> property);
+static char_u *V8ToVimString(Handle<Value> v8obj);
+static std::string V8ToStdString(Handle<Value> v8obj);
+static bool is_ascii(const char *s, size_t len);
+static Handle<String> MakeV8String(const char *s, size_t len);
+static bool ItemToV8(const void *item, typval_T *tv, Handle<Value> *v8obj, std::string *err);
+static void StringCacheDestroy(const WeakCallbackData<String, StringCacheEntry>& data);
 static bool vim_to_v8(typval_T *vimobj, Handle<Value> *v8obj, int depth, VimToV8Lookup *lookup, std::string *err);
 static bool v8_to_vim(Handle<Value> v8obj, typval_T *vimobj, int depth, V8ToVimLookup *lookup, std::string *err);
-
-static void weak_ref(typval_T *tv);
-static void weak_unref(typval_T *tv);
+static bool vim_to_v8_copy(typval_T *vimobj, Handle<Value> *v8obj, int depth, bool deep, VimToV8CopyLookup *lookup, std::string *err);
+static bool v8_to_vim_ref(Handle<Value> v8obj, typval_T *vimobj);
+static std::string VimToLiteral(typval_T *tv);
+
+static listitem_T *pin(typval_T *tv);
+static void unpin(listitem_T *li);
+static void ReleaseQueued(size_t max);
+static size_t ReleaseBatch();
+static bool ReleaseUntil(double deadline);
+static double NowMs();
+static VimListIndex *NewListIndex();
+static void FreeListIndex(VimListIndex *idx);
 
 static Handle<String> ReadFile(const char* name);
-static bool ExecuteString(Handle<String> source, Handle<Value> name, bool print_result, bool report_exceptions, std::string& err);
+static std::string ParseOptions(const std::string& args);
+static bool ParseOption(const std::string& flag);
+static void GCEpilogue(Isolate *isolate, GCType type, GCCallbackFlags flags);
+static bool HeapLimitCheck();
+static bool HeapLimitCancel();
+static bool GetOption(const std::string& flag, const char *name, std::string *value);
+static Handle<Script> CompileCached(const char *source, size_t len, const char *name);
+static Handle<Script> CompileCodeCache(Handle<String> source, Handle<Value> name, const char *kind);
+static std::string CodeCachePath(const std::string& file, const char *kind);
+static std::string CodeCacheHeader(const struct stat& st);
+static bool ExecuteString(Handle<String> source, Handle<Value> name, bool print_result, bool report_exceptions, std::string& err, CacheMode cache = NO_CACHE);
+static bool RunScript(Handle<Script> script, TryCatch *try_catch, bool print_result, bool report_exceptions, std::string& err);
 static void ReportException(TryCatch* try_catch);
 
 // functions
+static void vim_try_start();
+static bool vim_try_end(std::string *err);
+static bool CallVimFunc(char_u *name, typval_T *argvars, dict_T *selfdict, Handle<Value> *result);
+static bool VimExecute(const std::string& cmd, std::string *err);
+static bool VimExecuteWithValue(const std::string& cmd, typval_T *tv, std::string *err);
+static bool VimLet(const std::string& name, Handle<Value> value, std::string *err);
+static bool VimEcho(Handle<Value> value, std::string *err);
+static bool IsVarName(const std::string& name);
 static void vim_execute(const FunctionCallbackInfo<Value>& args);
+static void vim_let(const FunctionCallbackInfo<Value>& args);
+static void vim_echo(const FunctionCallbackInfo<Value>& args);
+static void vim_call(const FunctionCallbackInfo<Value>& args);
+static bool VimEval(const std::string& expr, bool copy, Handle<Value> *result, std::string *err);
+static void vim_eval(const FunctionCallbackInfo<Value>& args);
+static void vim_batch(const FunctionCallbackInfo<Value>& args);
+static void vim_stats(const FunctionCallbackInfo<Value>& args);
+static void vim_heapStatistics(const FunctionCallbackInfo<Value>& args);
+static void vim_toJS(const FunctionCallbackInfo<Value>& args);
+static void vim_ListToArray(const FunctionCallbackInfo<Value>& args);
+static void vim_DictToObject(const FunctionCallbackInfo<Value>& args);
+static void vim_toFloat64Array(const FunctionCallbackInfo<Value>& args);
+static void vim_toInt32Array(const FunctionCallbackInfo<Value>& args);
+static void vim_fromTypedArray(const FunctionCallbackInfo<Value>& args);
+static void ListToTypedArray(const FunctionCallbackInfo<Value>& args, bool is_float);
+static void ExternalBufferDestroy(const WeakCallbackData<ArrayBuffer, ExternalBuffer>& data);
 static void Load(const FunctionCallbackInfo<Value>& args);
+static bool LoadFile(const std::string& file, std::string *err);
+static void Require(const FunctionCallbackInfo<Value>& args);
+static bool ResolveModule(const std::string& name, const std::string& base, std::string *path, struct stat *st);
+static bool FullPath(const std::string& file, std::string *path);
+static const char *preload(const std::vector<std::string>& files);
 
 // VimList
 static Handle<Value> MakeVimList(list_T *list);
+static listitem_T *VimListFind(Handle<Object> self, list_T *list, uint32_t index);
 static void VimListCreate(const FunctionCallbackInfo<Value>& args);
-static void VimListDestroy(const WeakCallbackData<Value, typval_T>& data);
+static void VimListDestroy(const WeakCallbackData<Value, listitem_T>& data);
 static void VimListGet(uint32_t index, const PropertyCallbackInfo<Value>& info);
 static void VimListSet(uint32_t index, Local<Value> value, const PropertyCallbackInfo<Value>& info);
 static void VimListQuery(uint32_t index, const PropertyCallbackInfo<Integer>& info);
 static void VimListDelete(uint32_t index, const PropertyCallbackInfo<Boolean>& info);
 static void VimListEnumerate(const PropertyCallbackInfo<Array>& info);
 static void VimListLength(Local<String> property, const PropertyCallbackInfo<Value>& info);
+static void VimListForEach(const FunctionCallbackInfo<Value>& args);
+static void VimListValues(const FunctionCallbackInfo<Value>& args);
+static void VimListIterNext(const FunctionCallbackInfo<Value>& args);
+static void VimListIterSelf(const FunctionCallbackInfo<Value>& args);
+static void VimListIterFinish(VimListIter *iter);
+static void VimListIterDestroy(const WeakCallbackData<Object, VimListIter>& data);
 
 // VimDict
 static Handle<Value> MakeVimDict(dict_T *dict);
-static void VimDictDestroy(const WeakCallbackData<Value, typval_T>& data);
+static void VimDictDestroy(const WeakCallbackData<Value, listitem_T>& data);
 static void VimDictCreate(const FunctionCallbackInfo<Value>& args);
 static void VimDictIdxGet(uint32_t index, const PropertyCallbackInfo<Value>& info);
 static void VimDictIdxSet(uint32_t index, Local<Value> value, const PropertyCallbackInfo<Value>& info);
@@ -151,10 +580,15 @@ static void VimDictSet(Local<String> property, Local<Value> value, const Propert
 static void VimDictQuery(Local<String> property, const PropertyCallbackInfo<Integer>& info);
 static void VimDictDelete(Local<String> property, const PropertyCallbackInfo<Boolean>& info);
 static void VimDictEnumerate(const PropertyCallbackInfo<Array>& info);
+static void VimDictGetKey(char_u *key, hash_T hash, Handle<Value> property, const PropertyCallbackInfo<Value>& info);
+static bool VimDictConvert(Local<Value> value, typval_T *vimobj);
+static void VimDictSetKey(char_u *key, hash_T hash, typval_T *vimobj, Local<Value> value, const PropertyCallbackInfo<Value>& info);
+static void VimDictQueryKey(char_u *key, hash_T hash, const PropertyCallbackInfo<Integer>& info);
+static void VimDictDeleteKey(char_u *key, hash_T hash, const PropertyCallbackInfo<Boolean>& info);
 
 // VimFunc
 static Handle<Value> MakeVimFunc(const char *name);
-static void VimFuncDestroy(const WeakCallbackData<Value, typval_T>& data);
+static void VimFuncDestroy(const WeakCallbackData<Value, listitem_T>& data);
 static void VimFuncCall(const FunctionCallbackInfo<Value>& args);
 
 struct Trace {
@@ -175,7 +609,9 @@ struct Trace {
 # define TRACE(name)
 #endif
 
-/* args = dll_path,v8_args */
+/* args = dll_path,v8_args[\noption][\nfile]...
+ * An option line starts with "--if_v8_" and is taken as a whole.  Each
+ * file is loaded into the new context before returning. */
 const char *
 init(const char *_args)
 {
@@ -185,6 +621,21 @@ init(const char *_args)
   size_t pos = args.find(",", 0);
   std::string dll_path = args.substr(0, pos);
   std::string v8_args = args.substr(pos + 1);
+  std::vector<std::string> files;
+  pos = v8_args.find("\n", 0);
+  if (pos != std::string::npos) {
+    std::istringstream in(v8_args.substr(pos + 1));
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.compare(0, 8, "--if_v8_") == 0) {
+        if (!ParseOption(line))
+          return "error: unknown option";
+      } else if (!line.empty()) {
+        files.push_back(line);
+      }
+    }
+    v8_args.erase(pos);
+  }
   if (dll_handle != NULL)
     return NULL;
   if ((dll_handle = DLOPEN(dll_path.c_str())) == NULL)
@@ -193,6 +644,38 @@ init(const char *_args)
     return err;
   if ((err = init_v8(v8_args)) != NULL)
     return err;
+  if ((err = preload(files)) != NULL)
+    return err;
+  return NULL;
+}
+
+// Load the runtime and user libraries given to init().  Together with the
+// code cache this replaces a libcall() round trip per file.
+static const char *
+preload(const std::vector<std::string>& files)
+{
+  TRACE("preload");
+  static std::string msg;
+  Isolate::Scope isolate_scope(isolate);
+  HandleScope handle_scope(isolate);
+  Local<Context> context = Local<Context>::New(isolate, p_context);
+  Context::Scope context_scope(context);
+  Handle<String> script_name = String::NewFromUtf8(isolate, "%script_name%");
+  for (size_t i = 0; i < files.size(); ++i) {
+    HandleScope scope(isolate);
+    context->Global()->Set(script_name, String::NewFromUtf8(isolate, files[i].c_str()));
+    std::string err;
+    ++script_running;
+    bool ok = LoadFile(files[i], &err);
+    --script_running;
+    context->Global()->Delete(script_name);
+    if (HeapLimitCancel())
+      err = HEAP_LIMIT_MSG;
+    if (!ok) {
+      msg = "error: " + files[i] + ": " + err;
+      return msg.c_str();
+    }
+  }
   return NULL;
 }
 
@@ -200,15 +683,258 @@ const char *
 execute(const char *expr)
 {
   TRACE("execute");
+  ReleaseQueued(ReleaseBatch());
+  ++vim_generation;
+  Isolate::Scope isolate_scope(isolate);
+  HandleScope handle_scope(isolate);
+  Context::Scope context_scope(Local<Context>::New(isolate, p_context));
+  std::string err;
+  TryCatch try_catch;
+  ++script_running;
+  bool ok = RunScript(CompileCached(expr, strlen(expr), "(command-line)"), &try_catch, true, true, err);
+  --script_running;
+  if (!HeapLimitCheck() && !ok)
+    emsg((char_u*)err.c_str());
+  return NULL;
+}
+
+// Evaluate JavaScript expression "expr" and return the result as a Vim
+// expression, for eval(libcall(dll, 'evaluate', expr)).  A Number, Float,
+// String or Funcref is returned as a literal.  A List or Dictionary keeps
+// its identity (it may be a VimList/VimDict or recursive), so it is put in
+// g:__if_v8['%v8_result%'] and that variable is returned.  On error the
+// message is reported and "0" is returned.
+const char *
+evaluate(const char *expr)
+{
+  TRACE("evaluate");
+  static std::string result;
+  ReleaseQueued(ReleaseBatch());
+  ++vim_generation;
   Isolate::Scope isolate_scope(isolate);
   HandleScope handle_scope(isolate);
   Context::Scope context_scope(Local<Context>::New(isolate, p_context));
+  TryCatch try_catch;
   std::string err;
-  if (!ExecuteString(String::NewFromUtf8(isolate, expr), String::NewFromUtf8(isolate, "(command-line)"), true, true, err))
+  std::string source = std::string("(") + expr + "\n)";
+  Handle<Script> script = CompileCached(source.data(), source.size(), "(command-line)");
+  Handle<Value> value;
+  if (!script.IsEmpty()) {
+    ++script_running;
+    value = script->Run();
+    --script_running;
+  }
+  if (HeapLimitCheck())
+    return "0";
+  if (value.IsEmpty()) {
+    err = V8ToStdString(try_catch.Exception());
+    ReportException(&try_catch);
+    emsg((char_u*)err.c_str());
+    return "0";
+  }
+  V8ToVimLookup lookup;
+  typval_T tv;
+  if (!v8_to_vim(value, &tv, 1, &lookup, &err)) {
     emsg((char_u*)err.c_str());
+    return "0";
+  }
+  if (tv.v_type == VAR_LIST || tv.v_type == VAR_DICT) {
+    dict_set_tv_nocopy(v_reg, (char_u*)"%v8_result%", &tv);
+    return "g:__if_v8['%v8_result%']";
+  }
+  result = VimToLiteral(&tv);
+  clear_tv(&tv);
+  return result.c_str();
+}
+
+// Literal of a Number, Float, String or Funcref.  Unlike string(), a Float
+// keeps full precision.
+static std::string
+VimToLiteral(typval_T *tv)
+{
+  std::ostringstream strm;
+  switch (tv->v_type) {
+  case VAR_NUMBER:
+    strm << (long)tv->vval.v_number;
+    break;
+#ifdef FEAT_FLOAT
+  case VAR_FLOAT:
+    {
+      float_T f = tv->vval.v_float;
+      // isnan() and isinf() are macros in C99 but std:: functions in
+      // C++11, so compare instead.
+      if (f != f) {
+        strm << "str2float('nan')";
+      } else if (f == HUGE_VAL || f == -HUGE_VAL) {
+        strm << (f > 0 ? "str2float('inf')" : "-str2float('inf')");
+      } else {
+        strm.precision(17);
+        strm << f;
+        // A Float literal needs a "." before the exponent.
+        std::string num = strm.str();
+        size_t e = num.find('e');
+        if (num.find('.') == std::string::npos)
+          num.insert(e == std::string::npos ? num.size() : e, ".0");
+        return num;
+      }
+      break;
+    }
+#endif
+  case VAR_STRING:
+  case VAR_FUNC:
+    if (tv->v_type == VAR_FUNC)
+      strm << "function(";
+    strm << "'";
+    for (char_u *p = tv->vval.v_string; p != NULL && *p != '\0'; ++p) {
+      if (*p == '\'')
+        strm << "'";
+      strm << (char)*p;
+    }
+    strm << "'";
+    if (tv->v_type == VAR_FUNC)
+      strm << ")";
+    break;
+  default:
+    strm << "0";
+    break;
+  }
+  return strm.str();
+}
+
+// Called from CursorHold.  Releases the values of collected wrappers and
+// gives V8 up to options.idle_budget ms for incremental GC, so that
+// unreachable wrappers are collected and release their Vim values without
+// a full stop-the-world gc().  Nothing is done when little was allocated
+// and no wrapper was made since the last GC: a small wrapper may hold a
+// large Vim value, which the JS heap size does not show.
+const char *
+idle(const char *arg)
+{
+  TRACE("idle");
+  // CursorHold still fires after a failed init().
+  if (isolate == NULL || v_pinned == NULL)
+    return NULL;
+  double deadline = NowMs() + options.idle_budget;
+  if (!ReleaseUntil(deadline))
+    return NULL;
+  Isolate::Scope isolate_scope(isolate);
+  HandleScope handle_scope(isolate);
+  HeapStatistics heap;
+  isolate->GetHeapStatistics(&heap);
+  if (heap.used_heap_size() < heap_used_after_gc + options.idle_threshold
+      && v_pinned->lv_len <= pinned_after_gc) {
+    ++idle_skipped;
+    return NULL;
+  }
+  int budget = (int)(deadline - NowMs());
+  ++idle_gc;
+  isolate->IdleNotification(budget > 1 ? budget : 1);
+  ReleaseUntil(deadline);
   return NULL;
 }
 
+static void
+GCEpilogue(Isolate *, GCType type, GCCallbackFlags flags)
+{
+  HeapStatistics heap;
+  isolate->GetHeapStatistics(&heap);
+  heap_used_after_gc = heap.used_heap_size();
+  pinned_after_gc = v_pinned->lv_len - (int)release_queue.size();
+  size_t limit = options.heap_soft_limit;
+  if (limit == 0)
+    limit = heap.heap_size_limit() / 10 * 9;
+  if (script_running > 0 && !heap_limit_terminated && heap_used_after_gc >= limit) {
+    heap_limit_terminated = true;
+    isolate->TerminateExecution();
+  }
+}
+
+// Called when the outermost script returned.  Returns true and reports it
+// when the script was terminated by the heap soft limit.
+static bool
+HeapLimitCheck()
+{
+  if (!HeapLimitCancel())
+    return false;
+  emsg((char_u*)"if_v8: " HEAP_LIMIT_MSG);
+  return true;
+}
+
+// Same as HeapLimitCheck() but leaves reporting to the caller.
+static bool
+HeapLimitCancel()
+{
+  if (script_running > 0 || !heap_limit_terminated)
+    return false;
+  heap_limit_terminated = false;
+  isolate->CancelTerminateExecution();
+  isolate->LowMemoryNotification();
+  return true;
+}
+
+// Take the if_v8 options out of "args" and return the rest.
+static std::string
+ParseOptions(const std::string& args)
+{
+  TRACE("ParseOptions");
+  std::istringstream in(args);
+  std::string flag;
+  std::string rest;
+  while (in >> flag) {
+    if (ParseOption(flag))
+      continue;
+    if (!rest.empty())
+      rest += " ";
+    rest += flag;
+  }
+  return rest;
+}
+
+// Set the option of "flag" when it is an if_v8 option.
+static bool
+ParseOption(const std::string& flag)
+{
+  std::string value;
+  if (GetOption(flag, "--if_v8_code_cache", &options.code_cache_dir))
+    return true;
+  if (GetOption(flag, "--if_v8_mmap", &value)) {
+    options.mmap = value == "1";
+    return true;
+  }
+  if (GetOption(flag, "--if_v8_idle_budget", &value)) {
+    options.idle_budget = atoi(value.c_str());
+    return true;
+  }
+  if (GetOption(flag, "--if_v8_idle_threshold", &value)) {
+    options.idle_threshold = (size_t)atol(value.c_str()) * 1024;
+    return true;
+  }
+  if (GetOption(flag, "--if_v8_max_old_space", &value)) {
+    options.max_old_space = atoi(value.c_str());
+    return true;
+  }
+  if (GetOption(flag, "--if_v8_max_semi_space", &value)) {
+    options.max_semi_space = atoi(value.c_str());
+    return true;
+  }
+  if (GetOption(flag, "--if_v8_heap_soft_limit", &value)) {
+    options.heap_soft_limit = (size_t)atol(value.c_str()) * 1024 * 1024;
+    return true;
+  }
+  return false;
+}
+
+// Returns true and sets "value" when "flag" is "name=value".
+static bool
+GetOption(const std::string& flag, const char *name, std::string *value)
+{
+  size_t len = strlen(name);
+  if (flag.compare(0, len, name) != 0 || flag.size() <= len || flag[len] != '=')
+    return false;
+  *value = flag.substr(len + 1);
+  return true;
+}
+
 static const char *
 init_v8(std::string args)
 {
@@ -218,9 +944,24 @@ init_v8(std::string args)
   Platform* platform = v8::platform::CreateDefaultPlatform();
   V8::InitializePlatform(platform);
   V8::Initialize();
+  args = ParseOptions(args);
   V8::SetFlagsFromString(args.c_str(), args.length());
+  V8::SetArrayBufferAllocator(&array_buffer_allocator);
 
+  // Isolate::New() of this V8 takes no CreateParams.  The heap of the new
+  // isolate is set up when it is entered first, so the constraints are set
+  // before that.  Without them V8 runs with its default limits.
   isolate = Isolate::New();
+  if (options.max_old_space > 0 || options.max_semi_space > 0) {
+    ResourceConstraints rc;
+    if (options.max_old_space > 0)
+      rc.set_max_old_space_size(options.max_old_space);
+    if (options.max_semi_space > 0)
+      rc.set_max_semi_space_size(options.max_semi_space);
+    if (!SetResourceConstraints(isolate, &rc))
+      emsg((char_u*)"if_v8: cannot set heap limits, using the defaults");
+  }
+  isolate->AddGCEpilogueCallback(GCEpilogue);
 
   Isolate::Scope isolate_scope(isolate);
   HandleScope handle_scope(isolate);
@@ -233,20 +974,31 @@ init_v8(std::string args)
   v_reg = ptv->vval.v_dict;
   free_tv(ptv);
 
-  v_weak = dict_alloc();
-  if (v_weak == NULL)
-    return "init_v8(): error dict_alloc()";
+  v_pinned = list_alloc();
+  if (v_pinned == NULL)
+    return "init_v8(): error list_alloc()";
   typval_T tv;
-  tv_set_dict(&tv, v_weak);
-  dict_set_tv_nocopy(v_reg, (char_u*)"%v8_weak%", &tv);
+  tv_set_list(&tv, v_pinned);
+  dict_set_tv_nocopy(v_reg, (char_u*)"%v8_pinned%", &tv);
 
   p_VimList.Reset(isolate, FunctionTemplate::New(isolate, VimListCreate));
   Local<FunctionTemplate> VimList = Local<FunctionTemplate>::New(isolate, p_VimList);
   VimList->SetClassName(String::NewFromUtf8(isolate, "VimList"));
   Handle<ObjectTemplate> VimListTemplate = VimList->InstanceTemplate();
-  VimListTemplate->SetInternalFieldCount(1);
+  // [0]=list_T*  [1]=VimListIndex* or undef
+  VimListTemplate->SetInternalFieldCount(2);
   VimListTemplate->SetIndexedPropertyHandler(VimListGet, VimListSet, VimListQuery, VimListDelete, VimListEnumerate);
   VimListTemplate->SetAccessor(String::NewFromUtf8(isolate, "length"), VimListLength, NULL, Handle<Value>(), DEFAULT, (PropertyAttribute)(DontEnum|DontDelete));
+  Handle<ObjectTemplate> VimListPrototype = VimList->PrototypeTemplate();
+  VimListPrototype->Set(String::NewFromUtf8(isolate, "forEach"), FunctionTemplate::New(isolate, VimListForEach), DontEnum);
+  VimListPrototype->Set(String::NewFromUtf8(isolate, "values"), FunctionTemplate::New(isolate, VimListValues), DontEnum);
+
+  p_VimListIter.Reset(isolate, FunctionTemplate::New(isolate));
+  Local<FunctionTemplate> VimListIter = Local<FunctionTemplate>::New(isolate, p_VimListIter);
+  VimListIter->SetClassName(String::NewFromUtf8(isolate, "VimListIterator"));
+  // [0]=VimListIter*  [1]=VimList
+  VimListIter->InstanceTemplate()->SetInternalFieldCount(2);
+  VimListIter->PrototypeTemplate()->Set(String::NewFromUtf8(isolate, "next"), FunctionTemplate::New(isolate, VimListIterNext), DontEnum);
 
   p_VimDict.Reset(isolate, FunctionTemplate::New(isolate, VimDictCreate));
   Local<FunctionTemplate> VimDict = Local<FunctionTemplate>::New(isolate, p_VimDict);
@@ -266,12 +1018,26 @@ init_v8(std::string args)
 
   Handle<ObjectTemplate> vim = ObjectTemplate::New();
   vim->Set(String::NewFromUtf8(isolate, "execute"), FunctionTemplate::New(isolate, vim_execute));
+  vim->Set(String::NewFromUtf8(isolate, "let"), FunctionTemplate::New(isolate, vim_let));
+  vim->Set(String::NewFromUtf8(isolate, "echo"), FunctionTemplate::New(isolate, vim_echo));
+  vim->Set(String::NewFromUtf8(isolate, "batch"), FunctionTemplate::New(isolate, vim_batch));
+  vim->Set(String::NewFromUtf8(isolate, "call"), FunctionTemplate::New(isolate, vim_call));
+  vim->Set(String::NewFromUtf8(isolate, "eval"), FunctionTemplate::New(isolate, vim_eval));
+  vim->Set(String::NewFromUtf8(isolate, "stats"), FunctionTemplate::New(isolate, vim_stats));
+  vim->Set(String::NewFromUtf8(isolate, "heapStatistics"), FunctionTemplate::New(isolate, vim_heapStatistics));
+  vim->Set(String::NewFromUtf8(isolate, "toJS"), FunctionTemplate::New(isolate, vim_toJS));
+  vim->Set(String::NewFromUtf8(isolate, "ListToArray"), FunctionTemplate::New(isolate, vim_ListToArray));
+  vim->Set(String::NewFromUtf8(isolate, "DictToObject"), FunctionTemplate::New(isolate, vim_DictToObject));
+  vim->Set(String::NewFromUtf8(isolate, "toFloat64Array"), FunctionTemplate::New(isolate, vim_toFloat64Array));
+  vim->Set(String::NewFromUtf8(isolate, "toInt32Array"), FunctionTemplate::New(isolate, vim_toInt32Array));
+  vim->Set(String::NewFromUtf8(isolate, "fromTypedArray"), FunctionTemplate::New(isolate, vim_fromTypedArray));
   vim->Set(String::NewFromUtf8(isolate, "List"), VimList);
   vim->Set(String::NewFromUtf8(isolate, "Dict"), VimDict);
   vim->Set(String::NewFromUtf8(isolate, "Func"), VimFunc);
 
   Handle<ObjectTemplate> global = ObjectTemplate::New();
   global->Set(String::NewFromUtf8(isolate, "load"), FunctionTemplate::New(isolate, Load));
+  global->Set(String::NewFromUtf8(isolate, "require"), FunctionTemplate::New(isolate, Require));
   global->Set(String::NewFromUtf8(isolate, "vim"), vim);
 
   p_context.Reset(isolate, Context::New(isolate, NULL, global));
@@ -282,11 +1048,192 @@ init_v8(std::string args)
     Handle<Object> obj = Handle<Object>::Cast(context->Global()->Get(String::NewFromUtf8(isolate, "vim")));
     obj->Set(String::NewFromUtf8(isolate, "g"), MakeVimDict(&globvardict));
     obj->Set(String::NewFromUtf8(isolate, "v"), MakeVimDict(&vimvardict));
+
+    // Template::Set() does not take a Symbol.  Set @@iterator on the
+    // prototype objects instead.
+    Handle<String> prototype = String::NewFromUtf8(isolate, "prototype");
+    Handle<Object> listproto = Handle<Object>::Cast(VimList->GetFunction()->Get(prototype));
+    listproto->ForceSet(Symbol::GetIterator(isolate), listproto->Get(String::NewFromUtf8(isolate, "values")), DontEnum);
+    Handle<Object> iterproto = Handle<Object>::Cast(VimListIter->GetFunction()->Get(prototype));
+    iterproto->ForceSet(Symbol::GetIterator(isolate), FunctionTemplate::New(isolate, VimListIterSelf)->GetFunction(), DontEnum);
   }
 
   return NULL;
 }
 
+static Handle<String>
+InternKey(char_u *key, hash_T hash)
+{
+  CopyableStringPersistent *p = interned.get(HashKey(hash, (char *)key));
+  if (p != NULL)
+    return Local<String>::New(isolate, *p);
+  if (interned.size() >= INTERN_MAX) {
+    interned.clear();
+    for (size_t i = 0; i < intern_keys.size(); ++i)
+      free(intern_keys[i]);
+    intern_keys.clear();
+  }
+  size_t len = STRLEN(key);
+  char *copy = (char *)malloc(len + 1);
+  Handle<String> str = String::NewFromUtf8(isolate, (char *)key, String::kInternalizedString, (int)len);
+  if (copy == NULL)
+    return str;
+  memcpy(copy, key, len + 1);
+  intern_keys.push_back(copy);
+  interned.set(HashKey(hash, copy), CopyableStringPersistent())->Reset(isolate, str);
+  return str;
+}
+
+static DictKey *
+LookupDictKey(Handle<String> property)
+{
+  for (int i = 0; i < DICTKEY_CACHE_SIZE; ++i) {
+    if (!dictkey_cache[i].name.IsEmpty() && dictkey_cache[i].name == property)
+      return &dictkey_cache[i];
+  }
+  int length = property->Length();
+  {
+    // Do not leave a handle per slot in the caller's scope.
+    HandleScope handle_scope(isolate);
+    for (int i = 0; i < DICTKEY_CACHE_SIZE; ++i) {
+      DictKey *k = &dictkey_cache[i];
+      if (!k->name.IsEmpty() && k->length == length
+          && Local<String>::New(isolate, k->name)->StrictEquals(property))
+        return k;
+    }
+  }
+  DictKey *k = &dictkey_scratch;
+  int len = property->Utf8Length();
+  k->key.resize(len);
+  if (len > 0)
+    property->WriteUtf8(&k->key[0], len, NULL, String::NO_NULL_TERMINATION);
+  k->hash = hash_hash((char_u *)k->key.c_str());
+  hash_T *seen = &dictkey_seen[k->hash % DICTKEY_SEEN_SIZE];
+  if (*seen != k->hash) {
+    *seen = k->hash;
+    return k;
+  }
+  DictKey *c = &dictkey_cache[dictkey_next];
+  dictkey_next = (dictkey_next + 1) % DICTKEY_CACHE_SIZE;
+  c->name.Reset(isolate, property);
+  c->length = length;
+  c->key.swap(k->key);
+  c->hash = k->hash;
+  return c;
+}
+
+// Convert to string and write it as UTF-8 straight into a buffer from
+// alloc(), instead of copying out of a String::Utf8Value.  When the UTF-8
+// length equals the number of characters the string is ASCII, which is
+// written with the faster WriteOneByte().  Returns NULL on failure.
+static char_u *
+V8ToVimString(Handle<Value> v8obj)
+{
+  Handle<String> str = v8obj->ToString();
+  if (str.IsEmpty())
+    return NULL;
+  int length = str->Length();
+  int utf8len = str->Utf8Length();
+  char_u *buf = alloc(utf8len + 1);
+  if (buf == NULL)
+    return NULL;
+  if (utf8len == length)
+    str->WriteOneByte((uint8_t*)buf, 0, length, String::NO_NULL_TERMINATION);
+  else
+    str->WriteUtf8((char*)buf, utf8len, NULL, String::NO_NULL_TERMINATION);
+  buf[utf8len] = '\0';
+  return buf;
+}
+
+// Same as V8ToVimString() but into a std::string.  Returns "" on failure.
+static std::string
+V8ToStdString(Handle<Value> v8obj)
+{
+  std::string res;
+  if (v8obj.IsEmpty())
+    return res;
+  Handle<String> str = v8obj->ToString();
+  if (str.IsEmpty())
+    return res;
+  int length = str->Length();
+  int utf8len = str->Utf8Length();
+  if (utf8len == 0)
+    return res;
+  res.resize(utf8len);
+  if (utf8len == length)
+    str->WriteOneByte((uint8_t*)&res[0], 0, length, String::NO_NULL_TERMINATION);
+  else
+    str->WriteUtf8(&res[0], utf8len, NULL, String::NO_NULL_TERMINATION);
+  return res;
+}
+
+// Check 8 bytes at a time for a byte with the high bit set.
+static bool
+is_ascii(const char *s, size_t len)
+{
+  const size_t highbits = (size_t)-1 / 0xff * 0x80;
+  size_t i = 0;
+  for (; i < len && ((size_t)(s + i) & (sizeof(size_t) - 1)) != 0; ++i)
+    if (s[i] & 0x80)
+      return false;
+  for (; i + sizeof(size_t) <= len; i += sizeof(size_t))
+    if (*(const size_t *)(s + i) & highbits)
+      return false;
+  for (; i < len; ++i)
+    if (s[i] & 0x80)
+      return false;
+  return true;
+}
+
+static Handle<String>
+MakeV8String(const char *s, size_t len)
+{
+  if (len >= EXTERNAL_STRING_MIN && is_ascii(s, len)) {
+    char *data = (char *)malloc(len);
+    if (data != NULL) {
+      memcpy(data, s, len);
+      return String::NewExternal(isolate, new VimStringResource(data, len));
+    }
+  }
+  return String::NewFromUtf8(isolate, s, String::kNormalString, (int)len);
+}
+
+// vim_to_v8() for the value of List or Dictionary item "item".
+static bool
+ItemToV8(const void *item, typval_T *tv, Handle<Value> *v8obj, std::string *err)
+{
+  if (tv->v_type != VAR_STRING || tv->vval.v_string == NULL)
+    return vim_to_v8(tv, v8obj, 1, &objcache, err);
+  StringCacheEntry *e = &string_cache[VimValue::ptr_hash((void *)item) % STRING_CACHE_SIZE];
+  if (e->item == item && e->str == tv->vval.v_string
+      && e->generation == vim_generation
+      && e->string_generation == string_generation
+      && !e->handle.IsEmpty()) {
+    *v8obj = Local<String>::New(isolate, e->handle);
+    return true;
+  }
+  size_t len = STRLEN(tv->vval.v_string);
+  Handle<String> str = MakeV8String((char *)tv->vval.v_string, len);
+  if (len >= EXTERNAL_STRING_MIN) {
+    e->item = item;
+    e->str = tv->vval.v_string;
+    e->generation = vim_generation;
+    e->string_generation = string_generation;
+    e->handle.Reset(isolate, str);
+    e->handle.SetWeak(e, StringCacheDestroy);
+  }
+  *v8obj = str;
+  return true;
+}
+
+static void
+StringCacheDestroy(const WeakCallbackData<String, StringCacheEntry>& data)
+{
+  StringCacheEntry *e = data.GetParameter();
+  e->handle.Reset();
+  e->item = NULL;
+}
+
 static bool
 vim_to_v8(typval_T *vimobj, Handle<Value> *v8obj, int depth, VimToV8Lookup *lookup, std::string *err)
 {
@@ -310,9 +1257,9 @@ vim_to_v8(typval_T *vimobj, Handle<Value> *v8obj, int depth, VimToV8Lookup *look
 
   if (vimobj->v_type == VAR_STRING) {
     if (vimobj->vval.v_string == NULL)
-      *v8obj = String::NewFromUtf8(isolate, "");
+      *v8obj = String::Empty(isolate);
     else
-      *v8obj = String::NewFromUtf8(isolate, (char *)vimobj->vval.v_string);
+      *v8obj = MakeV8String((char *)vimobj->vval.v_string, STRLEN(vimobj->vval.v_string));
     return true;
   }
 
@@ -322,28 +1269,13 @@ vim_to_v8(typval_T *vimobj, Handle<Value> *v8obj, int depth, VimToV8Lookup *look
       *v8obj = Array::New(0);
       return true;
     }
-    VimToV8Lookup::iterator it = lookup->get(VimValue(list));
-    if (it != lookup->end()) {
-      *v8obj = Local<Value>::New(isolate, it->second);
+    CopyableValuePersistent *cached = lookup->get(VimValue(list));
+    if (cached != NULL) {
+      *v8obj = Local<Value>::New(isolate, *cached);
       return true;
     }
-#if 1
     *v8obj = MakeVimList(list);
     return true;
-#else
-    // copy by value
-    Handle<Array> o = Array::New(0);
-    Handle<Value> v;
-    int i = 0;
-    lookup->set(VimValue(list), o);
-    for (listitem_T *curr = list->lv_first; curr != NULL; curr = curr->li_next) {
-      if (!vim_to_v8(&curr->li_tv, &v, depth + 1, lookup, err))
-        return false;
-      o->Set(Integer::New(isolate, i++), v);
-    }
-    *v8obj = o;
-    return true;
-#endif
   }
 
   if (vimobj->v_type == VAR_DICT) {
@@ -352,41 +1284,19 @@ vim_to_v8(typval_T *vimobj, Handle<Value> *v8obj, int depth, VimToV8Lookup *look
       *v8obj = Object::New(isolate);
       return true;
     }
-    VimToV8Lookup::iterator it = lookup->get(VimValue(dict));
-    if (it != lookup->end()) {
-      *v8obj = Local<Value>::New(isolate, it->second);
+    CopyableValuePersistent *cached = lookup->get(VimValue(dict));
+    if (cached != NULL) {
+      *v8obj = Local<Value>::New(isolate, *cached);
       return true;
     }
-#if 1
     *v8obj = MakeVimDict(dict);
     return true;
-#else
-    // copy by value
-    Handle<Object> o = Object::New(isolate);
-    Handle<Value> v;
-    hashtab_T *ht = &dict->dv_hashtab;
-    long_u todo = ht->ht_used;
-    hashitem_T *hi;
-    dictitem_T *di;
-    lookup->set(VimValue(dict), o);
-    for (hi = ht->ht_array; todo > 0; ++hi) {
-      if (!HASHITEM_EMPTY(hi)) {
-        --todo;
-        di = HI2DI(hi);
-        if (!vim_to_v8(&di->di_tv, &v, depth + 1, lookup, err))
-          return false;
-        o->Set(String::NewFromUtf8(isolate, (char *)hi->hi_key), v);
-      }
-    }
-    *v8obj = o;
-    return true;
-#endif
   }
 
   if (vimobj->v_type == VAR_FUNC) {
-    VimToV8Lookup::iterator it = lookup->get(VimValue(vimobj->vval.v_string));
-    if (it != lookup->end()) {
-      *v8obj = Local<Value>::New(isolate, it->second);
+    CopyableValuePersistent *cached = lookup->get(VimValue(vimobj->vval.v_string));
+    if (cached != NULL) {
+      *v8obj = Local<Value>::New(isolate, *cached);
       return true;
     }
     *v8obj = MakeVimFunc((char *)vimobj->vval.v_string);
@@ -397,21 +1307,121 @@ vim_to_v8(typval_T *vimobj, Handle<Value> *v8obj, int depth, VimToV8Lookup *look
   return false;
 }
 
+// Convert a List/Dictionary to a real Array/Object (copy by value).  When
+// "deep" is false only the top level is copied and the items are converted
+// with vim_to_v8().  Other types are converted with vim_to_v8().
 static bool
-v8_to_vim(Handle<Value> v8obj, typval_T *vimobj, int depth, V8ToVimLookup *lookup, std::string *err)
+vim_to_v8_copy(typval_T *vimobj, Handle<Value> *v8obj, int depth, bool deep, VimToV8CopyLookup *lookup, std::string *err)
 {
-  TRACE("v8_to_vim");
+  TRACE("vim_to_v8_copy");
   if (depth > 100) {
-    *err = "v8_to_vim(): too deep";
+    *err = "vim_to_v8_copy(): too deep";
     return false;
   }
 
-  Local<FunctionTemplate> VimList = Local<FunctionTemplate>::New(isolate, p_VimList);
-  Local<FunctionTemplate> VimDict = Local<FunctionTemplate>::New(isolate, p_VimDict);
-  Local<FunctionTemplate> VimFunc = Local<FunctionTemplate>::New(isolate, p_VimFunc);
+  if (vimobj->v_type == VAR_LIST && vimobj->vval.v_list != NULL) {
+    list_T *list = vimobj->vval.v_list;
+    Handle<Value> *seen = lookup->get(VimValue(list));
+    if (seen != NULL) {
+      *v8obj = *seen;
+      return true;
+    }
+    Handle<Array> o = Array::New(isolate, list_len(list));
+    Handle<Value> v;
+    uint32_t i = 0;
+    lookup->set(VimValue(list), o);
+    for (listitem_T *curr = list->lv_first; curr != NULL; curr = curr->li_next) {
+      if (deep) {
+        if (!vim_to_v8_copy(&curr->li_tv, &v, depth + 1, deep, lookup, err))
+          return false;
+      } else {
+        if (!vim_to_v8(&curr->li_tv, &v, depth + 1, &objcache, err))
+          return false;
+      }
+      o->Set(i++, v);
+    }
+    *v8obj = o;
+    return true;
+  }
 
-  if (VimList->HasInstance(v8obj)) {
-    Handle<Object> o = Handle<Object>::Cast(v8obj);
+  if (vimobj->v_type == VAR_DICT && vimobj->vval.v_dict != NULL) {
+    dict_T *dict = vimobj->vval.v_dict;
+    Handle<Value> *seen = lookup->get(VimValue(dict));
+    if (seen != NULL) {
+      *v8obj = *seen;
+      return true;
+    }
+    // This V8 cannot pre-size an Object; only Arrays are pre-sized.
+    // Copies of Dictionaries with the same keys still share hidden
+    // classes through the internalized keys.
+    Handle<Object> o = Object::New(isolate);
+    Handle<Value> v;
+    hashtab_T *ht = &dict->dv_hashtab;
+    long_u todo = ht->ht_used;
+    hashitem_T *hi;
+    dictitem_T *di;
+    lookup->set(VimValue(dict), o);
+    for (hi = ht->ht_array; todo > 0; ++hi) {
+      if (!HASHITEM_EMPTY(hi)) {
+        --todo;
+        di = HI2DI(hi);
+        if (deep) {
+          if (!vim_to_v8_copy(&di->di_tv, &v, depth + 1, deep, lookup, err))
+            return false;
+        } else {
+          if (!vim_to_v8(&di->di_tv, &v, depth + 1, &objcache, err))
+            return false;
+        }
+        // internalized keys give the copies shared hidden classes
+        o->Set(InternKey(hi->hi_key, hi->hi_hash), v);
+      }
+    }
+    *v8obj = o;
+    return true;
+  }
+
+  return vim_to_v8(vimobj, v8obj, depth, &objcache, err);
+}
+
+// Borrow the List/Dictionary of a VimList/VimDict wrapper into "vimobj"
+// without touching the reference count.  Returns false for other values.
+static bool
+v8_to_vim_ref(Handle<Value> v8obj, typval_T *vimobj)
+{
+  Local<FunctionTemplate> VimList = Local<FunctionTemplate>::New(isolate, p_VimList);
+  Local<FunctionTemplate> VimDict = Local<FunctionTemplate>::New(isolate, p_VimDict);
+  if (VimList->HasInstance(v8obj)) {
+    Handle<External> external = Handle<External>::Cast(Handle<Object>::Cast(v8obj)->GetInternalField(0));
+    vimobj->v_type = VAR_LIST;
+    vimobj->v_lock = 0;
+    vimobj->vval.v_list = static_cast<list_T*>(external->Value());
+    return true;
+  }
+  if (VimDict->HasInstance(v8obj)) {
+    Handle<External> external = Handle<External>::Cast(Handle<Object>::Cast(v8obj)->GetInternalField(0));
+    vimobj->v_type = VAR_DICT;
+    vimobj->v_lock = 0;
+    vimobj->vval.v_dict = static_cast<dict_T*>(external->Value());
+    return true;
+  }
+  return false;
+}
+
+static bool
+v8_to_vim(Handle<Value> v8obj, typval_T *vimobj, int depth, V8ToVimLookup *lookup, std::string *err)
+{
+  TRACE("v8_to_vim");
+  if (depth > 100) {
+    *err = "v8_to_vim(): too deep";
+    return false;
+  }
+
+  Local<FunctionTemplate> VimList = Local<FunctionTemplate>::New(isolate, p_VimList);
+  Local<FunctionTemplate> VimDict = Local<FunctionTemplate>::New(isolate, p_VimDict);
+  Local<FunctionTemplate> VimFunc = Local<FunctionTemplate>::New(isolate, p_VimFunc);
+
+  if (VimList->HasInstance(v8obj)) {
+    Handle<Object> o = Handle<Object>::Cast(v8obj);
     Handle<External> external = Handle<External>::Cast(o->GetInternalField(0));
     tv_set_list(vimobj, static_cast<list_T*>(external->Value()));
     return true;
@@ -458,25 +1468,59 @@ v8_to_vim(Handle<Value> v8obj, typval_T *vimobj, int depth, V8ToVimLookup *looku
   }
 #endif
 
-  if (v8obj->IsString()) {
-    tv_set_string(vimobj, (char_u*)(*String::Utf8Value(v8obj)));
+  if (v8obj->IsString() || v8obj->IsDate()) {
+    char_u *str = V8ToVimString(v8obj);
+    if (str == NULL) {
+      *err = "v8_to_vim(): cannot convert string";
+      return false;
+    }
+    tv_set_string_nocopy(vimobj, str);
     return true;
   }
 
-  if (v8obj->IsDate()) {
-    tv_set_string(vimobj, (char_u*)(*String::Utf8Value(v8obj)));
+  if (v8obj->IsTypedArray()) {
+    // The element type is the same for all items, so decide once whether
+    // they become Number or Float.
+    Handle<TypedArray> o = Handle<TypedArray>::Cast(v8obj);
+    bool is_float = v8obj->IsFloat64Array() || v8obj->IsFloat32Array();
+    bool is_uint32 = v8obj->IsUint32Array();
+    size_t len = o->Length();
+    list_T *list = list_alloc();
+    if (list == NULL) {
+      *err = "v8_to_vim(): list_alloc(): out of memory";
+      return false;
+    }
+    for (size_t i = 0; i < len; ) {
+      HandleScope handle_scope(isolate);
+      for (size_t end = i + 1024; i < len && i < end; ++i) {
+        Handle<Value> v = o->Get((uint32_t)i);
+        typval_T tv;
+#ifdef FEAT_FLOAT
+        if (is_float || (is_uint32 && v->Uint32Value() > 0x7fffffffU))
+          tv_set_float(&tv, v->NumberValue());
+        else
+#endif
+          tv_set_number(&tv, v->Int32Value());
+        if (!list_append_tv_nocopy(list, &tv)) {
+          list_free(list, TRUE);
+          *err = "v8_to_vim(): list_append_tv_nocopy() error";
+          return false;
+        }
+      }
+    }
+    tv_set_list(vimobj, list);
     return true;
   }
 
   if (v8obj->IsArray()) {
-    V8ToVimLookup::iterator it = lookup->get(v8obj);
-    if (it != lookup->end()) {
-      tv_set_list(vimobj, it->second.vval.v_list);
+    VimValue *seen = lookup->get(v8obj);
+    if (seen != NULL) {
+      tv_set_list(vimobj, seen->vval.v_list);
       return true;
     }
     list_T *list = list_alloc();
     if (list == NULL) {
-      *err = "v8_to_vim(): list_alloc(): out of memoty";
+      *err = "v8_to_vim(): list_alloc(): out of memory";
       return false;
     }
     Handle<Array> o = Handle<Array>::Cast(v8obj);
@@ -501,9 +1545,9 @@ v8_to_vim(Handle<Value> v8obj, typval_T *vimobj, int depth, V8ToVimLookup *looku
   }
 
   if (v8obj->IsObject()) {
-    V8ToVimLookup::iterator it = lookup->get(v8obj);
-    if (it != lookup->end()) {
-      tv_set_dict(vimobj, it->second.vval.v_dict);
+    VimValue *seen = lookup->get(v8obj);
+    if (seen != NULL) {
+      tv_set_dict(vimobj, seen->vval.v_dict);
       return true;
     }
     dict_T *dict = dict_alloc();
@@ -550,165 +1594,1184 @@ v8_to_vim(Handle<Value> v8obj, typval_T *vimobj, int depth, V8ToVimLookup *looku
     return false;
   }
 
-  *err = "v8_to_vim(): unknown type";
-  return false;
+  *err = "v8_to_vim(): unknown type";
+  return false;
+}
+
+// Move "tv" into a new item of the pinned list.  The value is owned by the
+// item until unpin().
+static listitem_T *
+pin(typval_T *tv)
+{
+  TRACE("pin");
+  listitem_T *li;
+  if (!pin_pool.empty()) {
+    ++pool_hits;
+    li = pin_pool.back();
+    pin_pool.pop_back();
+  } else {
+    ++pool_misses;
+    li = listitem_alloc();
+    if (li == NULL)
+      return NULL;
+  }
+  li->li_tv = *tv;
+  list_append(v_pinned, li);
+  return li;
+}
+
+static void
+unpin(listitem_T *li)
+{
+  TRACE("unpin");
+  list_remove(v_pinned, li, li);
+  if (pin_pool.size() < PIN_POOL_MAX) {
+    clear_tv(&li->li_tv);
+    pin_pool.push_back(li);
+  } else {
+    listitem_free(li);
+  }
+}
+
+// Unpin up to "max" values queued by the weak callbacks.
+static void
+ReleaseQueued(size_t max)
+{
+  TRACE("ReleaseQueued");
+  if (max > 0 && !release_queue.empty())
+    ++string_generation;
+  while (max-- > 0 && !release_queue.empty()) {
+    listitem_T *li = release_queue.back();
+    release_queue.pop_back();
+    unpin(li);
+    ++released;
+  }
+}
+
+// Number of queued values execute() and evaluate() release: more when the
+// queue grows, so that a long queue shrinks geometrically, but never so
+// many that one call stalls.
+static size_t
+ReleaseBatch()
+{
+  size_t n = release_queue.size() / 4;
+  if (n < RELEASE_BATCH)
+    return RELEASE_BATCH;
+  if (n > RELEASE_BATCH_MAX)
+    return RELEASE_BATCH_MAX;
+  return n;
+}
+
+// Release queued values RELEASE_BATCH at a time until the queue is empty
+// or "deadline" (NowMs()) has passed.  Returns true when it is empty.
+static bool
+ReleaseUntil(double deadline)
+{
+  while (!release_queue.empty()) {
+    if (NowMs() >= deadline)
+      return false;
+    ReleaseQueued(RELEASE_BATCH);
+  }
+  return true;
+}
+
+static double
+NowMs()
+{
+#ifdef WIN32
+  return (double)GetTickCount();
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#endif
+}
+
+static VimListIndex *
+NewListIndex()
+{
+  if (index_pool.empty()) {
+    ++pool_misses;
+    return new VimListIndex();
+  }
+  ++pool_hits;
+  VimListIndex *idx = index_pool.back();
+  index_pool.pop_back();
+  return idx;
+}
+
+static void
+FreeListIndex(VimListIndex *idx)
+{
+  if (index_pool.size() >= INDEX_POOL_MAX || idx->items.capacity() > INDEX_POOL_ITEMS_MAX) {
+    delete idx;
+    return;
+  }
+  idx->generation = 0;
+  idx->len = 0;
+  idx->accesses = 0;
+  idx->built = false;
+  idx->items.clear();
+  index_pool.push_back(idx);
+}
+
+// Reads a file into a v8 string.  With --if_v8_mmap=1 a large file is
+// mapped into memory.  If it is ASCII the mapping itself is the string,
+// otherwise it is copied only once, by V8.  The mapping is shared with the
+// file, so this is off by default: rewriting the file in place would
+// change the source under V8 or raise SIGBUS.
+static Handle<String>
+ReadFile(const char* name)
+{
+  TRACE("ReadFile");
+#ifndef WIN32
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return Handle<String>();
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 0 || (uint64_t)st.st_size > (uint64_t)String::kMaxLength) {
+    close(fd);
+    return Handle<String>();
+  }
+  size_t size = (size_t)st.st_size;
+  if (options.mmap && size >= EXTERNAL_STRING_MIN) {
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      return Handle<String>();
+    const char *chars = static_cast<const char *>(addr);
+    if (is_ascii(chars, size))
+      return String::NewExternal(isolate, new MappedFileResource(addr, size));
+    Handle<String> result = String::NewFromUtf8(isolate, chars, String::kNormalString, (int)size);
+    munmap(addr, size);
+    return result;
+  }
+  close(fd);
+#endif
+
+  FILE* file = fopen(name, "rb");
+  if (file == NULL) return Handle<String>();
+
+  std::string chars;
+  char buf[8192];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    chars.append(buf, n);
+  bool ok = !ferror(file) && chars.size() <= (size_t)String::kMaxLength;
+  fclose(file);
+  if (!ok)
+    return Handle<String>();
+  return String::NewFromUtf8(isolate, chars.data(), String::kNormalString, (int)chars.size());
+}
+
+// Compile "source" of "len" bytes or bind the cached compiled script to the
+// current context.  The cache is looked up with the bytes as given, so a
+// hit makes no V8 string.  Returns an empty handle when compilation
+// failed.
+static Handle<Script>
+CompileCached(const char *source, size_t len, const char *name)
+{
+  TRACE("CompileCached");
+  size_t hash = VimValue::str_hash((char_u*)name);
+  for (size_t i = 0; i < len; ++i)
+    hash = hash * 101 + (unsigned char)source[i];
+  ScriptCacheEntry *lru = &script_cache[0];
+  ++script_cache_clock;
+  for (int i = 0; i < SCRIPT_CACHE_SIZE; ++i) {
+    ScriptCacheEntry *e = &script_cache[i];
+    if (!e->script.IsEmpty() && e->hash == hash && e->source.size() == len
+        && memcmp(e->source.data(), source, len) == 0 && e->name == name) {
+      ++script_cache_hits;
+      e->last_used = script_cache_clock;
+      return Local<UnboundScript>::New(isolate, e->script)->BindToCurrentContext();
+    }
+    if (e->last_used < lru->last_used)
+      lru = e;
+  }
+  ++script_cache_misses;
+  ScriptOrigin origin(String::NewFromUtf8(isolate, name));
+  ScriptCompiler::Source script_source(String::NewFromUtf8(isolate, source, String::kNormalString, (int)len), origin);
+  Local<UnboundScript> script = ScriptCompiler::CompileUnbound(isolate, &script_source);
+  if (script.IsEmpty())
+    return Handle<Script>();
+  lru->hash = hash;
+  lru->source.assign(source, len);
+  lru->name = name;
+  lru->script.Reset(isolate, script);
+  lru->last_used = script_cache_clock;
+  return script->BindToCurrentContext();
+}
+
+// Compile a load()ed file using the code cache in options.code_cache_dir.
+// The cache file is used only when it was made by the same V8 version for
+// the same modification time and size of the file.  Otherwise, or when V8
+// rejects it, the file is compiled normally and a new cache is written.
+// "kind" tells apart caches of different sources made from the same file,
+// e.g. ".module" for the source wrapped by require().
+static Handle<Script>
+CompileCodeCache(Handle<String> source, Handle<Value> name, const char *kind)
+{
+  TRACE("CompileCodeCache");
+  std::string file = V8ToStdString(name);
+  struct stat st;
+  if (options.code_cache_dir.empty() || stat(file.c_str(), &st) != 0)
+    return Script::Compile(source, name->ToString());
+
+  // A relative name depends on the current directory.
+  std::string full;
+  if (!FullPath(file, &full))
+    return Script::Compile(source, name->ToString());
+  std::string path = CodeCachePath(full, kind);
+  std::string header = CodeCacheHeader(st);
+  std::string data;
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f != NULL) {
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      data.append(buf, n);
+    if (ferror(f))
+      data.clear();
+    fclose(f);
+  }
+
+  ScriptOrigin origin(name);
+  if (data.size() > header.size() && data.compare(0, header.size(), header) == 0) {
+    ScriptCompiler::CachedData *cached = new ScriptCompiler::CachedData(
+        (const uint8_t*)data.data() + header.size(), (int)(data.size() - header.size()));
+    ScriptCompiler::Source script_source(Local<String>::New(isolate, source), origin, cached);
+    Local<Script> script = ScriptCompiler::Compile(isolate, &script_source, ScriptCompiler::kConsumeCodeCache);
+    if (script.IsEmpty()) {
+      ++code_cache_misses;
+      return script;
+    }
+    if (!script_source.GetCachedData()->rejected) {
+      ++code_cache_hits;
+      return script;
+    }
+  }
+
+  ++code_cache_misses;
+  ScriptCompiler::Source script_source(Local<String>::New(isolate, source), origin);
+  Local<Script> script = ScriptCompiler::Compile(isolate, &script_source, ScriptCompiler::kProduceCodeCache);
+  const ScriptCompiler::CachedData *cached = script_source.GetCachedData();
+  if (script.IsEmpty() || cached == NULL || cached->length <= 0)
+    return script;
+  // Write to a temporary file of this process and rename it, so that
+  // another Vim never reads a partially written cache.
+  std::ostringstream tmpname;
+  tmpname << path << "." << getpid() << ".tmp";
+  std::string tmp = tmpname.str();
+  f = fopen(tmp.c_str(), "wb");
+  if (f == NULL)
+    return script;
+  bool ok = fwrite(header.data(), 1, header.size(), f) == header.size()
+    && fwrite(cached->data, 1, cached->length, f) == (size_t)cached->length;
+  ok = fclose(f) == 0 && ok;
+  remove(path.c_str());
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    remove(tmp.c_str());
+  return script;
+}
+
+// Cache file of "file", an absolute path: the path with separators
+// replaced by '%' and "kind" appended, in options.code_cache_dir.
+static std::string
+CodeCachePath(const std::string& file, const char *kind)
+{
+  std::string name = file;
+  for (size_t i = 0; i < name.size(); ++i)
+    if (name[i] == '/' || name[i] == '\\' || name[i] == ':')
+      name[i] = '%';
+  return options.code_cache_dir + "/" + name + kind + ".cache";
+}
+
+static std::string
+CodeCacheHeader(const struct stat& st)
+{
+  std::ostringstream strm;
+  strm << "if_v8 code cache " << V8::GetVersion() << " " << (long)st.st_mtime << " " << (long)st.st_size << "\n";
+  return strm.str();
+}
+
+static bool
+ExecuteString(Handle<String> source, Handle<Value> name, bool print_result, bool report_exceptions, std::string& err, CacheMode cache)
+{
+  TRACE("ExecuteString");
+  HandleScope handle_scope(isolate);
+  TryCatch try_catch;
+  Handle<Script> script;
+  if (cache == CODE_CACHE)
+    script = CompileCodeCache(source, name, "");
+  else
+    script = Script::Compile(source, name->ToString());
+  return RunScript(script, &try_catch, print_result, report_exceptions, err);
+}
+
+// Run a script compiled under "try_catch".  An empty "script" is a
+// compile error.
+static bool
+RunScript(Handle<Script> script, TryCatch *try_catch, bool print_result, bool report_exceptions, std::string& err)
+{
+  TRACE("RunScript");
+  if (script.IsEmpty()) {
+    err = V8ToStdString(try_catch->Exception());
+    if (report_exceptions)
+      ReportException(try_catch);
+    return false;
+  }
+  Handle<Value> result = script->Run();
+  if (result.IsEmpty()) {
+    err = V8ToStdString(try_catch->Exception());
+    if (report_exceptions)
+      ReportException(try_catch);
+    return false;
+  }
+  if (print_result && !result->IsUndefined()) {
+    char_u *str = V8ToVimString(result);
+    if (str != NULL) {
+      typval_T tv;
+      tv_set_string_nocopy(&tv, str);
+      dict_set_tv_nocopy(v_reg, (char_u*)"%v8_print%", &tv);
+    }
+  }
+  return true;
+}
+
+static void
+ReportException(TryCatch* try_catch)
+{
+  TRACE("ReportException");
+  HandleScope handle_scope(isolate);
+  std::string exception = V8ToStdString(try_catch->Exception());
+  Handle<Message> message = try_catch->Message();
+  std::ostringstream strm;
+  if (message.IsEmpty()) {
+    // V8 didn't provide any extra information about this error; just
+    // print the exception.
+    strm << exception << "\n";
+  } else {
+    // Print (filename):(line number): (message).
+    int linenum = message->GetLineNumber();
+    strm << V8ToStdString(message->GetScriptResourceName()) << ":" << linenum << ": " << exception << "\n";
+    // Print line of source code.
+    strm << V8ToStdString(message->GetSourceLine()) << "\n";
+    // Print wavy underline (GetUnderline is deprecated).
+    int start = message->GetStartColumn();
+    for (int i = 0; i < start; i++) {
+      strm << " ";
+    }
+    int end = message->GetEndColumn();
+    for (int i = start; i < end; i++) {
+      strm << "^";
+    }
+    strm << "\n";
+  }
+  std::string msg = strm.str();
+  typval_T tv;
+  tv_set_string_nocopy(&tv, vim_strnsave((char_u*)msg.data(), (int)msg.size()));
+  dict_set_tv_nocopy(v_reg, (char_u*)"%v8_errmsg%", &tv);
+}
+
+// Run Vim code with errors and exceptions captured instead of displayed.
+// Same as VimTryStart()/VimTryEnd() in if_py_both.h.
+static void
+vim_try_start()
+{
+  ++trylevel;
+  ++vim_generation;
+}
+
+// Returns false and sets "err" when an error, exception or interrupt
+// occurred since vim_try_start().
+static bool
+vim_try_end(std::string *err)
+{
+  --trylevel;
+  // Without this Vim stops processing the following commands.
+  did_emsg = FALSE;
+  // Keyboard interrupt should be preferred over anything else.
+  if (got_int) {
+    if (did_throw)
+      discard_current_exception();
+    got_int = FALSE;
+    *err = "Vim:Interrupt";
+    return false;
+  } else if (msg_list != NULL && *msg_list != NULL) {
+    int should_free;
+    char_u *msg = get_exception_string(*msg_list, ET_ERROR, NULL, &should_free);
+    *err = msg == NULL ? "Vim: out of memory" : (char *)msg;
+    free_global_msglist();
+    if (msg != NULL && should_free)
+      vim_free(msg);
+    return false;
+  } else if (did_throw) {
+    *err = (char *)current_exception->value;
+    discard_current_exception();
+    return false;
+  }
+  return true;
+}
+
+// Call Vim function "name" with the List "argvars" and convert the result.
+// Vim errors are thrown as JS exceptions.
+static bool
+CallVimFunc(char_u *name, typval_T *argvars, dict_T *selfdict, Handle<Value> *result)
+{
+  TRACE("CallVimFunc");
+  typval_T rettv;
+  rettv.v_type = VAR_UNKNOWN;
+  std::string err;
+  vim_try_start();
+  int r = func_call(name, argvars, selfdict, &rettv);
+  if (!vim_try_end(&err)) {
+    clear_tv(&rettv);
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return false;
+  }
+  if (r == FAIL || rettv.v_type == VAR_UNKNOWN) {
+    clear_tv(&rettv);
+    err = "Vim:E117: cannot call function: ";
+    err += (char *)name;
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return false;
+  }
+  bool ok = vim_to_v8(&rettv, result, 1, &objcache, &err);
+  clear_tv(&rettv);
+  if (!ok) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return false;
+  }
+  return true;
+}
+
+// vim.call(func, args [, self])
+// "func" is a function name or VimFunc, "args" an Array or VimList and
+// "self" a VimDict or Object for dictionary functions.
+static void
+vim_call(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_call");
+  HandleScope handle_scope(isolate);
+  Local<FunctionTemplate> VimFunc = Local<FunctionTemplate>::New(isolate, p_VimFunc);
+
+  if (args.Length() < 2 || args.Length() > 3
+      || !(args[0]->IsString() || VimFunc->HasInstance(args[0]))) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: call(func, args [, self])"));
+    return;
+  }
+
+  std::string name;
+  if (args[0]->IsString())
+    name = V8ToStdString(args[0]);
+  else
+    name = static_cast<char *>(Handle<External>::Cast(Handle<Object>::Cast(args[0])->GetInternalField(0))->Value());
+
+  V8ToVimLookup lookup;
+  std::string err;
+  typval_T argvars;
+  if (!v8_to_vim(args[1], &argvars, 1, &lookup, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  if (argvars.v_type != VAR_LIST) {
+    clear_tv(&argvars);
+    isolate->ThrowException(String::NewFromUtf8(isolate, "call(): args must be a List"));
+    return;
+  }
+
+  typval_T self;
+  self.v_type = VAR_UNKNOWN;
+  if (args.Length() == 3 && !args[2]->IsUndefined()) {
+    if (!v8_to_vim(args[2], &self, 1, &lookup, &err)) {
+      clear_tv(&argvars);
+      isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+      return;
+    }
+    if (self.v_type != VAR_DICT) {
+      clear_tv(&argvars);
+      clear_tv(&self);
+      isolate->ThrowException(String::NewFromUtf8(isolate, "call(): self must be a Dictionary"));
+      return;
+    }
+  }
+
+  Handle<Value> result;
+  bool ok = CallVimFunc((char_u*)name.c_str(), &argvars,
+      self.v_type == VAR_DICT ? self.vval.v_dict : NULL, &result);
+  clear_tv(&argvars);
+  clear_tv(&self);
+  if (ok)
+    args.GetReturnValue().Set(result);
+}
+
+// Evaluate Vim expression "expr".  Returns false and sets "err" to the
+// Vim error or exception message on failure.
+static bool
+VimEval(const std::string& expr, bool copy, Handle<Value> *result, std::string *err)
+{
+  TRACE("VimEval");
+  vim_try_start();
+  typval_T *tv = eval_expr((char_u*)expr.c_str(), NULL);
+  if (!vim_try_end(err)) {
+    if (tv != NULL)
+      free_tv(tv);
+    return false;
+  }
+  if (tv == NULL) {
+    *err = "Vim:E15: Invalid expression: " + expr;
+    return false;
+  }
+  bool ok;
+  if (copy) {
+    VimToV8CopyLookup lookup;
+    ok = vim_to_v8_copy(tv, result, 1, true, &lookup, err);
+  } else {
+    ok = vim_to_v8(tv, result, 1, &objcache, err);
+  }
+  free_tv(tv);
+  return ok;
+}
+
+// vim.eval(expr [, {copy: bool}])
+// With copy, Lists and Dictionaries are returned as Arrays and Objects.
+static void
+vim_eval(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_eval");
+  HandleScope handle_scope(isolate);
+
+  if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsString()) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: eval(string expr [, {copy: bool}])"));
+    return;
+  }
+
+  bool copy = false;
+  if (args.Length() == 2 && args[1]->IsObject()) {
+    Handle<Object> opts = Handle<Object>::Cast(args[1]);
+    copy = opts->Get(String::NewFromUtf8(isolate, "copy"))->BooleanValue();
+  }
+
+  Handle<Value> v8obj;
+  std::string err;
+  if (!VimEval(V8ToStdString(args[0]), copy, &v8obj, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  args.GetReturnValue().Set(v8obj);
+}
+
+// Execute Ex command "cmd".  Returns false and sets "err" to the Vim error
+// or exception message on failure.
+static bool
+VimExecute(const std::string& cmd, std::string *err)
+{
+  TRACE("VimExecute");
+  vim_try_start();
+  do_cmdline_cmd((char_u*)cmd.c_str());
+  return vim_try_end(err);
+}
+
+// Execute "{cmd} g:__if_v8['%v8_value%']" with "tv" moved into that
+// register slot.  The slot is removed again afterwards.  Only for :let of
+// an option, register, environment variable or item, which set_var()
+// cannot do.
+static bool
+VimExecuteWithValue(const std::string& cmd, typval_T *tv, std::string *err)
+{
+  TRACE("VimExecuteWithValue");
+  if (!dict_set_tv_nocopy(v_reg, (char_u*)"%v8_value%", tv)) {
+    clear_tv(tv);
+    *err = "VimExecuteWithValue(): error dict_set_tv_nocopy()";
+    return false;
+  }
+  bool ok = VimExecute(cmd + " g:__if_v8['%v8_value%']", err);
+  dictitem_T *di = dict_find(v_reg, (char_u*)"%v8_value%", -1);
+  if (di != NULL)
+    dictitem_remove(v_reg, di);
+  return ok;
+}
+
+// ":let {name} = value".  A variable is set directly with set_var().
+static bool
+VimLet(const std::string& name, Handle<Value> value, std::string *err)
+{
+  TRACE("VimLet");
+  V8ToVimLookup lookup;
+  typval_T tv;
+  if (!v8_to_vim(value, &tv, 1, &lookup, err))
+    return false;
+  if (!IsVarName(name))
+    return VimExecuteWithValue("let " + name + " =", &tv, err);
+  vim_try_start();
+  // set_var() does not free "tv" on error, so let it copy.
+  set_var((char_u*)name.c_str(), &tv, TRUE);
+  clear_tv(&tv);
+  return vim_try_end(err);
+}
+
+// ":echo value".  A List or Dictionary is echoed as its string(), the
+// same text :echo shows, so that the command gets only a literal.
+static bool
+VimEcho(Handle<Value> value, std::string *err)
+{
+  TRACE("VimEcho");
+  V8ToVimLookup lookup;
+  typval_T tv;
+  if (!v8_to_vim(value, &tv, 1, &lookup, err))
+    return false;
+  if (tv.v_type == VAR_LIST || tv.v_type == VAR_DICT) {
+    list_T *list = list_alloc();
+    if (list == NULL || !list_append_tv_nocopy(list, &tv)) {
+      if (list != NULL)
+        list_free(list, TRUE);
+      clear_tv(&tv);
+      *err = "VimEcho(): out of memory";
+      return false;
+    }
+    typval_T argvars;
+    tv_set_list(&argvars, list);
+    tv.v_type = VAR_UNKNOWN;
+    vim_try_start();
+    func_call((char_u*)"string", &argvars, NULL, &tv);
+    clear_tv(&argvars);
+    if (!vim_try_end(err)) {
+      clear_tv(&tv);
+      return false;
+    }
+  }
+  std::string cmd = "echo " + VimToLiteral(&tv);
+  clear_tv(&tv);
+  return VimExecute(cmd, err);
+}
+
+// Whether ":let {name}" sets a plain variable, optionally with a g:, b:,
+// w:, t: or v: scope.
+static bool
+IsVarName(const std::string& name)
+{
+  size_t i = 0;
+  if (name.size() > 2 && name[1] == ':' && strchr("gbwtv", name[0]) != NULL)
+    i = 2;
+  if (i >= name.size() || !(isalpha((unsigned char)name[i]) || name[i] == '_'))
+    return false;
+  for (; i < name.size(); ++i)
+    if (!(isalnum((unsigned char)name[i]) || name[i] == '_' || name[i] == '#'))
+      return false;
+  return true;
+}
+
+// vim.execute(cmd)
+static void
+vim_execute(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_execute");
+  HandleScope handle_scope(isolate);
+
+  if (args.Length() != 1 || !args[0]->IsString()) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: execute(string cmd)"));
+    return;
+  }
+
+  std::string err;
+  if (!VimExecute(V8ToStdString(args[0]), &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+}
+
+// vim.batch(ops [, {stopOnError: bool}])
+// Run a sequence of operations in one call:
+//   {cmd: string}                  vim.execute(cmd), result is undefined
+//   {eval: string [, copy: bool]}  vim.eval(expr), result is the value
+//   {let: [varname, value]}        vim.let(varname, value)
+// Returns an Array with the result or an Error object for each operation.
+// With stopOnError, operations after the first failure are not run.
+static void
+vim_batch(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_batch");
+  HandleScope handle_scope(isolate);
+
+  if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsArray()) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: batch(Array ops [, {stopOnError: bool}])"));
+    return;
+  }
+
+  bool stop_on_error = false;
+  if (args.Length() == 2 && args[1]->IsObject()) {
+    Handle<Object> opts = Handle<Object>::Cast(args[1]);
+    stop_on_error = opts->Get(String::NewFromUtf8(isolate, "stopOnError"))->BooleanValue();
+  }
+
+  Handle<String> s_cmd = String::NewFromUtf8(isolate, "cmd");
+  Handle<String> s_eval = String::NewFromUtf8(isolate, "eval");
+  Handle<String> s_let = String::NewFromUtf8(isolate, "let");
+  Handle<String> s_copy = String::NewFromUtf8(isolate, "copy");
+
+  Handle<Array> ops = Handle<Array>::Cast(args[0]);
+  uint32_t len = ops->Length();
+  Handle<Array> results = Array::New(isolate);
+  for (uint32_t i = 0; i < len; ++i) {
+    HandleScope scope(isolate);
+    Handle<Value> v = ops->Get(i);
+    Handle<Value> result = Undefined(isolate);
+    std::string err;
+    bool ok;
+    if (!v->IsObject()) {
+      err = "batch(): operation must be an Object";
+      ok = false;
+    } else {
+      Handle<Object> op = Handle<Object>::Cast(v);
+      if (op->Has(s_cmd)) {
+        ok = VimExecute(V8ToStdString(op->Get(s_cmd)), &err);
+      } else if (op->Has(s_eval)) {
+        ok = VimEval(V8ToStdString(op->Get(s_eval)), op->Get(s_copy)->BooleanValue(), &result, &err);
+      } else if (op->Has(s_let) && op->Get(s_let)->IsArray()
+          && Handle<Array>::Cast(op->Get(s_let))->Length() == 2) {
+        Handle<Array> let = Handle<Array>::Cast(op->Get(s_let));
+        ok = VimLet(V8ToStdString(let->Get(0)), let->Get(1), &err);
+      } else {
+        err = "batch(): unknown operation";
+        ok = false;
+      }
+    }
+    if (!ok)
+      result = Exception::Error(String::NewFromUtf8(isolate, err.c_str()));
+    results->Set(i, result);
+    if (!ok && stop_on_error)
+      break;
+  }
+  args.GetReturnValue().Set(results);
+}
+
+// vim.let(varname, value)
+static void
+vim_let(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_let");
+  HandleScope handle_scope(isolate);
+
+  if (args.Length() != 2 || !args[0]->IsString()) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: let(string varname, value)"));
+    return;
+  }
+
+  std::string err;
+  if (!VimLet(V8ToStdString(args[0]), args[1], &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+}
+
+// vim.echo(value)
+static void
+vim_echo(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_echo");
+  HandleScope handle_scope(isolate);
+
+  if (args.Length() != 1) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: echo(value)"));
+    return;
+  }
+
+  std::string err;
+  if (!VimEcho(args[0], &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+}
+
+// Returns internal counters for tuning and leak hunting.
+//   objcache: number of live VimList/VimDict/VimFunc wrappers
+//   scriptcache_hits, scriptcache_misses: compiled script cache of execute()
+//   codecache_hits, codecache_misses: on disk code cache of load()
+//   idle_gc, idle_skipped: idle() calls that did or did not run GC
+//   pool, pool_hits, pool_misses: free lists of wrapper bookkeeping
+//   release_queue, released: Vim values of collected wrappers waiting to
+//                            be released, and released so far
+static void
+vim_stats(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_stats");
+  HandleScope handle_scope(isolate);
+  Handle<Object> stats = Object::New(isolate);
+  stats->Set(String::NewFromUtf8(isolate, "objcache"), Integer::NewFromUnsigned(isolate, objcache.size()));
+  stats->Set(String::NewFromUtf8(isolate, "scriptcache_hits"), Number::New(isolate, script_cache_hits));
+  stats->Set(String::NewFromUtf8(isolate, "scriptcache_misses"), Number::New(isolate, script_cache_misses));
+  stats->Set(String::NewFromUtf8(isolate, "codecache_hits"), Number::New(isolate, code_cache_hits));
+  stats->Set(String::NewFromUtf8(isolate, "codecache_misses"), Number::New(isolate, code_cache_misses));
+  stats->Set(String::NewFromUtf8(isolate, "idle_gc"), Number::New(isolate, idle_gc));
+  stats->Set(String::NewFromUtf8(isolate, "idle_skipped"), Number::New(isolate, idle_skipped));
+  stats->Set(String::NewFromUtf8(isolate, "pool"), Integer::NewFromUnsigned(isolate, (uint32_t)(pin_pool.size() + index_pool.size())));
+  stats->Set(String::NewFromUtf8(isolate, "pool_hits"), Number::New(isolate, pool_hits));
+  stats->Set(String::NewFromUtf8(isolate, "pool_misses"), Number::New(isolate, pool_misses));
+  stats->Set(String::NewFromUtf8(isolate, "release_queue"), Integer::NewFromUnsigned(isolate, (uint32_t)release_queue.size()));
+  stats->Set(String::NewFromUtf8(isolate, "released"), Number::New(isolate, released));
+  args.GetReturnValue().Set(stats);
+}
+
+// vim.heapStatistics()
+// Isolate::GetHeapStatistics() in bytes, with the soft limit at which a
+// running script is terminated.
+static void
+vim_heapStatistics(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_heapStatistics");
+  HandleScope handle_scope(isolate);
+  HeapStatistics heap;
+  isolate->GetHeapStatistics(&heap);
+  size_t soft_limit = options.heap_soft_limit;
+  if (soft_limit == 0)
+    soft_limit = heap.heap_size_limit() / 10 * 9;
+  Handle<Object> stats = Object::New(isolate);
+  stats->Set(String::NewFromUtf8(isolate, "total_heap_size"), Number::New(isolate, (double)heap.total_heap_size()));
+  stats->Set(String::NewFromUtf8(isolate, "total_heap_size_executable"), Number::New(isolate, (double)heap.total_heap_size_executable()));
+  stats->Set(String::NewFromUtf8(isolate, "total_physical_size"), Number::New(isolate, (double)heap.total_physical_size()));
+  stats->Set(String::NewFromUtf8(isolate, "used_heap_size"), Number::New(isolate, (double)heap.used_heap_size()));
+  stats->Set(String::NewFromUtf8(isolate, "heap_size_limit"), Number::New(isolate, (double)heap.heap_size_limit()));
+  stats->Set(String::NewFromUtf8(isolate, "heap_soft_limit"), Number::New(isolate, (double)soft_limit));
+  stats->Set(String::NewFromUtf8(isolate, "used_heap_size_after_gc"), Number::New(isolate, (double)heap_used_after_gc));
+  args.GetReturnValue().Set(stats);
+}
+
+// vim.toJS(value)
+// Deep copy of a VimList/VimDict into Arrays and Objects.  Other values are
+// returned as is.
+static void
+vim_toJS(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_toJS");
+  if (args.Length() != 1) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: toJS(value)"));
+    return;
+  }
+  typval_T tv;
+  if (!v8_to_vim_ref(args[0], &tv)) {
+    args.GetReturnValue().Set(args[0]);
+    return;
+  }
+  VimToV8CopyLookup lookup;
+  std::string err;
+  Handle<Value> v8obj;
+  if (!vim_to_v8_copy(&tv, &v8obj, 1, true, &lookup, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  args.GetReturnValue().Set(v8obj);
+}
+
+// vim.ListToArray(list), vim.DictToObject(dict)
+// Shallow copy: the items are converted as usual.
+static void
+vim_ListToArray(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_ListToArray");
+  typval_T tv;
+  if (args.Length() != 1 || !v8_to_vim_ref(args[0], &tv) || tv.v_type != VAR_LIST) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: ListToArray(VimList list)"));
+    return;
+  }
+  VimToV8CopyLookup lookup;
+  std::string err;
+  Handle<Value> v8obj;
+  if (!vim_to_v8_copy(&tv, &v8obj, 1, false, &lookup, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  args.GetReturnValue().Set(v8obj);
+}
+
+static void
+vim_DictToObject(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_DictToObject");
+  typval_T tv;
+  if (args.Length() != 1 || !v8_to_vim_ref(args[0], &tv) || tv.v_type != VAR_DICT) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: DictToObject(VimDict dict)"));
+    return;
+  }
+  VimToV8CopyLookup lookup;
+  std::string err;
+  Handle<Value> v8obj;
+  if (!vim_to_v8_copy(&tv, &v8obj, 1, false, &lookup, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  args.GetReturnValue().Set(v8obj);
+}
+
+// vim.toFloat64Array(list), vim.toInt32Array(list)
+// Items must be Number or Float.  They are written straight into the
+// backing store of a new ArrayBuffer.
+static void
+vim_toFloat64Array(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_toFloat64Array");
+  ListToTypedArray(args, true);
+}
+
+static void
+vim_toInt32Array(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("vim_toInt32Array");
+  ListToTypedArray(args, false);
+}
+
+static void
+ListToTypedArray(const FunctionCallbackInfo<Value>& args, bool is_float)
+{
+  typval_T tv;
+  if (args.Length() != 1 || !v8_to_vim_ref(args[0], &tv) || tv.v_type != VAR_LIST) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, is_float
+          ? "usage: toFloat64Array(VimList list)"
+          : "usage: toInt32Array(VimList list)"));
+    return;
+  }
+  list_T *list = tv.vval.v_list;
+  size_t len = list_len(list);
+  size_t length = len * (is_float ? sizeof(double) : sizeof(int32_t));
+  void *data = malloc(length == 0 ? 1 : length);
+  if (data == NULL) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "ListToTypedArray(): out of memory"));
+    return;
+  }
+  double *fp = static_cast<double*>(data);
+  int32_t *ip = static_cast<int32_t*>(data);
+  for (listitem_T *li = list->lv_first; li != NULL; li = li->li_next) {
+    double d;
+    if (li->li_tv.v_type == VAR_NUMBER)
+      d = li->li_tv.vval.v_number;
+#ifdef FEAT_FLOAT
+    else if (li->li_tv.v_type == VAR_FLOAT)
+      d = li->li_tv.vval.v_float;
+#endif
+    else {
+      free(data);
+      isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "ListToTypedArray(): item is not a Number or Float")));
+      return;
+    }
+    if (is_float)
+      *fp++ = d;
+    else if (!(d > -2147483649.0 && d < 2147483648.0))
+      *ip++ = (d > 0) ? 0x7fffffff : (d < 0) ? -0x7fffffff - 1 : 0;  // clamp, NaN is 0
+    else
+      *ip++ = (int32_t)d;
+  }
+
+  ExternalBuffer *buf = new ExternalBuffer();
+  buf->data = data;
+  buf->length = length;
+  Handle<ArrayBuffer> buffer = ArrayBuffer::New(isolate, data, length);
+  buf->handle.Reset(isolate, buffer);
+  buf->handle.SetWeak(buf, ExternalBufferDestroy);
+  isolate->AdjustAmountOfExternalAllocatedMemory(length);
+
+  if (is_float)
+    args.GetReturnValue().Set(Float64Array::New(buffer, 0, len));
+  else
+    args.GetReturnValue().Set(Int32Array::New(buffer, 0, len));
 }
 
 static void
-weak_ref(typval_T *tv)
+ExternalBufferDestroy(const WeakCallbackData<ArrayBuffer, ExternalBuffer>& data)
 {
-  TRACE("weak_ref");
-  char buf[64];
-  vim_snprintf(buf, sizeof(buf), (char*)"%p", tv);
-  dict_set_tv_nocopy(v_weak, (char_u*)buf, tv);
+  TRACE("ExternalBufferDestroy");
+  ExternalBuffer *buf = data.GetParameter();
+  isolate->AdjustAmountOfExternalAllocatedMemory(-(int64_t)buf->length);
+  free(buf->data);
+  buf->handle.Reset();
+  delete buf;
 }
 
+// vim.fromTypedArray(typedarray)
+// Returns a new VimList of Numbers (integer types) or Floats.
 static void
-weak_unref(typval_T *tv)
+vim_fromTypedArray(const FunctionCallbackInfo<Value>& args)
 {
-  TRACE("weak_unref");
-  char buf[64];
-  hashitem_T *hi;
-  dictitem_T *di;
-  vim_snprintf(buf, sizeof(buf), (char*)"%p", tv);
-  hi = hash_find(&v_weak->dv_hashtab, (char_u*)buf);
-  if (HASHITEM_EMPTY(hi)) {
-    emsg((char_u*)"if_v8: weak_unref(): internal error");
+  TRACE("vim_fromTypedArray");
+  if (args.Length() != 1 || !args[0]->IsTypedArray()) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: fromTypedArray(TypedArray array)"));
+    return;
+  }
+  V8ToVimLookup lookup;
+  std::string err;
+  typval_T tv;
+  if (!v8_to_vim(args[0], &tv, 1, &lookup, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
     return;
   }
-  // XXX: save di because hash_remove() clear it.
-  di = HI2DI(hi);
-  hash_remove(&v_weak->dv_hashtab, hi);
-  vim_free(di);
+  Handle<Value> v8obj;
+  bool ok = vim_to_v8(&tv, &v8obj, 1, &objcache, &err);
+  clear_tv(&tv);
+  if (!ok) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  args.GetReturnValue().Set(v8obj);
 }
 
-// Reads a file into a v8 string.
-static Handle<String>
-ReadFile(const char* name)
+// The callback that is invoked by v8 whenever the JavaScript 'load'
+// function is called.  Loads, compiles and executes its argument
+// JavaScript file.
+static void
+Load(const FunctionCallbackInfo<Value>& args)
 {
-  TRACE("ReadFile");
-  FILE* file = fopen(name, "rb");
-  if (file == NULL) return Handle<String>();
-
-  fseek(file, 0, SEEK_END);
-  int size = ftell(file);
-  rewind(file);
-
-  char* chars = new char[size + 1];
-  chars[size] = '\0';
-  for (int i = 0; i < size;) {
-    int read = fread(&chars[i], 1, size - i, file);
-    i += read;
+  TRACE("Load");
+  for (int i = 0; i < args.Length(); i++) {
+    HandleScope handle_scope(isolate);
+    std::string err;
+    if (!LoadFile(V8ToStdString(args[i]), &err)) {
+      isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+      return;
+    }
   }
-  fclose(file);
-  Handle<String> result = String::NewFromUtf8(isolate, chars, String::kNormalString, size);
-  delete[] chars;
-  return result;
 }
 
+// Read, compile (using the code cache) and run "file".
 static bool
-ExecuteString(Handle<String> source, Handle<Value> name, bool print_result, bool report_exceptions, std::string& err)
+LoadFile(const std::string& file, std::string *err)
 {
-  TRACE("ExecuteString");
+  TRACE("LoadFile");
   HandleScope handle_scope(isolate);
-  TryCatch try_catch;
-  Handle<Script> script = Script::Compile(source, name->ToString());
-  if (script.IsEmpty()) {
-    err = *(String::Utf8Value(try_catch.Exception()));
-    if (report_exceptions)
-      ReportException(&try_catch);
-    return false;
-  }
-  Handle<Value> result = script->Run();
-  if (result.IsEmpty()) {
-    err = *(String::Utf8Value(try_catch.Exception()));
-    if (report_exceptions)
-      ReportException(&try_catch);
+  Handle<String> source = ReadFile(file.c_str());
+  if (source.IsEmpty()) {
+    *err = "Error loading file";
     return false;
   }
-  if (print_result && !result->IsUndefined()) {
-    typval_T tv;
-    tv_set_string(&tv, (char_u*)(*String::Utf8Value(result)));
-    dict_set_tv_nocopy(v_reg, (char_u*)"%v8_print%", &tv);
-  }
-  return true;
-}
-
-static void
-ReportException(TryCatch* try_catch)
-{
-  TRACE("ReportException");
-  HandleScope handle_scope(isolate);
-  String::Utf8Value exception(try_catch->Exception());
-  Handle<Message> message = try_catch->Message();
-  std::ostringstream strm;
-  if (message.IsEmpty()) {
-    // V8 didn't provide any extra information about this error; just
-    // print the exception.
-    strm << *exception << "\n";
-  } else {
-    // Print (filename):(line number): (message).
-    String::Utf8Value filename(message->GetScriptResourceName());
-    int linenum = message->GetLineNumber();
-    strm << *filename << ":" << linenum << ": " << *exception << "\n";
-    // Print line of source code.
-    String::Utf8Value sourceline(message->GetSourceLine());
-    strm << *sourceline << "\n";
-    // Print wavy underline (GetUnderline is deprecated).
-    int start = message->GetStartColumn();
-    for (int i = 0; i < start; i++) {
-      strm << " ";
-    }
-    int end = message->GetEndColumn();
-    for (int i = start; i < end; i++) {
-      strm << "^";
-    }
-    strm << "\n";
-  }
-  typval_T tv;
-  tv_set_string(&tv, (char_u*)strm.str().c_str());
-  dict_set_tv_nocopy(v_reg, (char_u*)"%v8_errmsg%", &tv);
+  return ExecuteString(source, String::NewFromUtf8(isolate, file.c_str()), false, false, *err, CODE_CACHE);
 }
 
+// require(path)
+// CommonJS style module loader.  "path" is relative to the script calling
+// require() and ".js" may be omitted.  The file is run once in a function
+// wrapper with (exports, require, module, __filename, __dirname) and its
+// module.exports is cached until the file changes.
 static void
-vim_execute(const FunctionCallbackInfo<Value>& args)
+Require(const FunctionCallbackInfo<Value>& args)
 {
-  TRACE("vim_execute");
+  TRACE("Require");
   HandleScope handle_scope(isolate);
 
   if (args.Length() != 1 || !args[0]->IsString()) {
-    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: vim_execute(string cmd"));
+    isolate->ThrowException(String::NewFromUtf8(isolate, "usage: require(string path)"));
     return;
   }
 
-  String::Utf8Value cmd(args[0]);
-  if (!do_cmdline_cmd((char_u*)*cmd)) {
-    isolate->ThrowException(String::NewFromUtf8(isolate, "vim_execute(): error do_cmdline_cmd()"));
+  std::string base;
+  Local<StackTrace> trace = StackTrace::CurrentStackTrace(isolate, 1, StackTrace::kScriptName);
+  if (trace->GetFrameCount() > 0)
+    base = V8ToStdString(trace->GetFrame(0)->GetScriptName());
+
+  std::string name = V8ToStdString(args[0]);
+  std::string path;
+  struct stat st;
+  if (!ResolveModule(name, base, &path, &st)) {
+    std::string err = "Cannot find module '" + name + "'";
+    isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, err.c_str())));
     return;
   }
-}
 
-// The callback that is invoked by v8 whenever the JavaScript 'load'
-// function is called.  Loads, compiles and executes its argument
-// JavaScript file.
-static void
-Load(const FunctionCallbackInfo<Value>& args)
-{
-  TRACE("Load");
-  for (int i = 0; i < args.Length(); i++) {
-    HandleScope handle_scope(isolate);
-    String::Utf8Value file(args[i]);
-    Handle<String> source = ReadFile(*file);
-    if (source.IsEmpty()) {
-      isolate->ThrowException(String::NewFromUtf8(isolate, "Error loading file"));
+  Handle<String> s_exports = String::NewFromUtf8(isolate, "exports");
+  std::map<std::string, Module>::iterator it = modules.find(path);
+  if (it != modules.end()) {
+    if (it->second.mtime == st.st_mtime && it->second.size == st.st_size) {
+      Handle<Object> module = Handle<Object>::Cast(Local<Value>::New(isolate, it->second.module));
+      args.GetReturnValue().Set(module->Get(s_exports));
       return;
     }
-    std::string err;
-    if (!ExecuteString(source, String::NewFromUtf8(isolate, *file), false, false, err)) {
-      isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
-      return;
+    it->second.module.Reset();
+    modules.erase(it);
+  }
+
+  Handle<String> source = ReadFile(path.c_str());
+  if (source.IsEmpty()) {
+    std::string err = "Error loading file: " + path;
+    isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, err.c_str())));
+    return;
+  }
+  // Keep the wrapper on the first line, so that line numbers are not
+  // changed.
+  source = String::Concat(String::NewFromUtf8(isolate, "(function (exports, require, module, __filename, __dirname) {"), source);
+  source = String::Concat(source, String::NewFromUtf8(isolate, "\n})"));
+  Handle<String> filename = String::NewFromUtf8(isolate, path.c_str());
+  Handle<Script> script = CompileCodeCache(source, filename, ".module");
+  if (script.IsEmpty())
+    return;
+  Handle<Value> func = script->Run();
+  if (func.IsEmpty())
+    return;
+
+  Handle<Object> module = Object::New(isolate);
+  Handle<Object> exports = Object::New(isolate);
+  module->Set(s_exports, exports);
+  module->Set(String::NewFromUtf8(isolate, "id"), filename);
+
+  // Register before running, so that a cyclic require() gets the
+  // partially filled exports instead of loading the module again.
+  Module& entry = modules[path];
+  entry.module.Reset(isolate, module);
+  entry.mtime = st.st_mtime;
+  entry.size = st.st_size;
+
+  size_t pos = path.find_last_of("/\\");
+  std::string dir = pos == std::string::npos ? "." : path.substr(0, pos);
+  Handle<Value> argv[5] = {
+    exports,
+    args.Callee(),
+    module,
+    filename,
+    String::NewFromUtf8(isolate, dir.c_str())
+  };
+  if (Handle<Function>::Cast(func)->Call(exports, 5, argv).IsEmpty()) {
+    it = modules.find(path);
+    if (it != modules.end()) {
+      it->second.module.Reset();
+      modules.erase(it);
     }
+    return;
+  }
+  args.GetReturnValue().Set(module->Get(s_exports));
+}
+
+// Find the file of module "name" required from script "base" and set its
+// canonical path and stat.
+static bool
+ResolveModule(const std::string& name, const std::string& base, std::string *path, struct stat *st)
+{
+  TRACE("ResolveModule");
+  std::string file = name;
+  bool absolute = !name.empty() && (name[0] == '/' || name[0] == '\\'
+      || (name.size() > 1 && name[1] == ':'));
+  if (!absolute) {
+    size_t pos = base.find_last_of("/\\");
+    if (pos != std::string::npos)
+      file = base.substr(0, pos + 1) + name;
+  }
+  if (stat(file.c_str(), st) != 0 || (st->st_mode & S_IFMT) != S_IFREG) {
+    file += ".js";
+    if (stat(file.c_str(), st) != 0 || (st->st_mode & S_IFMT) != S_IFREG)
+      return false;
   }
+  return FullPath(file, path);
+}
+
+// Canonical absolute path of the existing file "file".
+static bool
+FullPath(const std::string& file, std::string *path)
+{
+#ifdef WIN32
+  char buf[_MAX_PATH];
+  if (_fullpath(buf, file.c_str(), sizeof(buf)) == NULL)
+    return false;
+#else
+  char buf[PATH_MAX];
+  if (realpath(file.c_str(), buf) == NULL)
+    return false;
+#endif
+  *path = buf;
+  return true;
 }
 
 static list_T *makelistptr = NULL;
@@ -728,15 +2791,19 @@ MakeVimList(list_T *list)
 }
 
 static void
-VimListDestroy(const WeakCallbackData<Value, typval_T>& data)
+VimListDestroy(const WeakCallbackData<Value, listitem_T>& data)
 {
   TRACE("VimListDestroy");
-  typval_T *tv = data.GetParameter();
+  listitem_T *li = data.GetParameter();
 
-  objcache.del(VimValue(tv->vval.v_list));
+  Handle<Object> self = Handle<Object>::Cast(data.GetValue());
+  Handle<Value> index = self->GetInternalField(1);
+  if (index->IsExternal())
+    FreeListIndex(static_cast<VimListIndex*>(Handle<External>::Cast(index)->Value()));
 
-  weak_unref(tv);
-  free_tv(tv);
+  objcache.del(VimValue(li->li_tv.vval.v_list));
+
+  release_queue.push_back(li);
 }
 
 static void
@@ -764,16 +2831,19 @@ VimListCreate(const FunctionCallbackInfo<Value>& args)
   self->SetInternalField(0, External::New(isolate, list));
 
   // increment Vim's reference count
-  typval_T *tv = alloc_tv();
-  tv_set_list(tv, list);
-  weak_ref(tv);
+  typval_T tv;
+  tv_set_list(&tv, list);
+  listitem_T *li = pin(&tv);
+  if (li == NULL) {
+    clear_tv(&tv);
+    isolate->ThrowException(String::NewFromUtf8(isolate, "VimListCreate(): pin(): out of memory"));
+    return;
+  }
 
   // make weak reference
-  CopyableValuePersistent p = CopyableValuePersistent();
-  p.Reset(isolate, self);
-  p.SetWeak(tv, VimListDestroy);
-
-  objcache.set(VimValue(list), p);
+  CopyableValuePersistent *p = objcache.set(VimValue(list), CopyableValuePersistent());
+  p->Reset(isolate, self);
+  p->SetWeak(li, VimListDestroy);
 
   args.GetReturnValue().Set(self);
 }
@@ -785,12 +2855,12 @@ VimListGet(uint32_t index, const PropertyCallbackInfo<Value>& info)
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   list_T *list = static_cast<list_T*>(external->Value());
-  listitem_T *li = list_find(list, index);
+  listitem_T *li = VimListFind(self, list, index);
   if (li == NULL)
     return;
   std::string err;
   Handle<Value> v8obj;
-  if (!vim_to_v8(&li->li_tv, &v8obj, 1, &objcache, &err)) {
+  if (!ItemToV8(li, &li->li_tv, &v8obj, &err)) {
     isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
     return;
   }
@@ -804,7 +2874,7 @@ VimListSet(uint32_t index, Local<Value> value, const PropertyCallbackInfo<Value>
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   list_T *list = static_cast<list_T*>(external->Value());
-  listitem_T *li = list_find(list, index);
+  listitem_T *li = VimListFind(self, list, index);
   if (li == NULL) {
     isolate->ThrowException(String::NewFromUtf8(isolate, "list index out of range"));
     return;
@@ -816,6 +2886,7 @@ VimListSet(uint32_t index, Local<Value> value, const PropertyCallbackInfo<Value>
     isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
     return;
   }
+  ++string_generation;
   clear_tv(&li->li_tv);
   li->li_tv = vimobj;
   info.GetReturnValue().Set(value);
@@ -828,8 +2899,7 @@ VimListQuery(uint32_t index, const PropertyCallbackInfo<Integer>& info)
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   list_T *list = static_cast<list_T*>(external->Value());
-  listitem_T *li = list_find(list, index);
-  if (li == NULL) {
+  if (index >= (uint32_t)list_len(list)) {
     info.GetReturnValue().Set(Integer::New(isolate, DontEnum));
     return;
   }
@@ -843,16 +2913,51 @@ VimListDelete(uint32_t index, const PropertyCallbackInfo<Boolean>& info)
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   list_T *list = static_cast<list_T*>(external->Value());
-  listitem_T *li = list_find(list, index);
+  listitem_T *li = VimListFind(self, list, index);
   if (li == NULL) {
     info.GetReturnValue().Set(False(isolate));
     return;
   }
+  ++vim_generation;
+  ++string_generation;
   list_remove(list, li, li);
   listitem_free(li);
   info.GetReturnValue().Set(True(isolate));
 }
 
+// Locate item "index" in "list" through the wrapper's side index.
+static listitem_T *
+VimListFind(Handle<Object> self, list_T *list, uint32_t index)
+{
+  TRACE("VimListFind");
+  VimListIndex *idx;
+  Handle<Value> field = self->GetInternalField(1);
+  if (field->IsExternal()) {
+    idx = static_cast<VimListIndex*>(Handle<External>::Cast(field)->Value());
+  } else {
+    idx = NewListIndex();
+    self->SetInternalField(1, External::New(isolate, idx));
+  }
+  if (idx->generation != vim_generation || idx->len != list_len(list)) {
+    idx->generation = vim_generation;
+    idx->len = list_len(list);
+    idx->accesses = 0;
+    idx->built = false;
+    idx->items.clear();
+  }
+  if (!idx->built) {
+    if (idx->accesses++ == 0)
+      return list_find(list, index);
+    idx->items.reserve(idx->len);
+    for (listitem_T *li = list->lv_first; li != NULL; li = li->li_next)
+      idx->items.push_back(li);
+    idx->built = true;
+  }
+  if (index >= idx->items.size())
+    return NULL;
+  return idx->items[index];
+}
+
 static void
 VimListEnumerate(const PropertyCallbackInfo<Array>& info)
 {
@@ -879,6 +2984,141 @@ VimListLength(Local<String> property, const PropertyCallbackInfo<Value>& info)
   info.GetReturnValue().Set(Integer::New(isolate, len));
 }
 
+// list.forEach(callback[, thisArg])
+// Walks the items with a watcher, so the callback may remove items from the
+// List.
+static void
+VimListForEach(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("VimListForEach");
+  Local<FunctionTemplate> VimList = Local<FunctionTemplate>::New(isolate, p_VimList);
+  if (!VimList->HasInstance(args.This())) {
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "forEach(): this is not a VimList")));
+    return;
+  }
+  if (args.Length() < 1 || !args[0]->IsFunction()) {
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "usage: forEach(function callback[, thisArg])")));
+    return;
+  }
+  Handle<Object> self = args.This();
+  Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
+  list_T *list = static_cast<list_T*>(external->Value());
+  Handle<Function> callback = Handle<Function>::Cast(args[0]);
+  Handle<Value> recv = args.Length() > 1 ? args[1] : Handle<Value>(Undefined(isolate));
+  listwatch_T lw;
+  uint32_t i = 0;
+  lw.lw_item = list->lv_first;
+  list_add_watch(list, &lw);
+  while (lw.lw_item != NULL) {
+    HandleScope handle_scope(isolate);
+    listitem_T *li = lw.lw_item;
+    lw.lw_item = li->li_next;
+    std::string err;
+    Handle<Value> v8obj;
+    if (!ItemToV8(li, &li->li_tv, &v8obj, &err)) {
+      list_rem_watch(list, &lw);
+      isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+      return;
+    }
+    Handle<Value> argv[3] = {v8obj, Integer::NewFromUnsigned(isolate, i++), self};
+    if (callback->Call(recv, 3, argv).IsEmpty()) {
+      list_rem_watch(list, &lw);
+      return;
+    }
+  }
+  list_rem_watch(list, &lw);
+}
+
+// list.values(), list[Symbol.iterator]()
+static void
+VimListValues(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("VimListValues");
+  Local<FunctionTemplate> VimList = Local<FunctionTemplate>::New(isolate, p_VimList);
+  Local<FunctionTemplate> VimListIterT = Local<FunctionTemplate>::New(isolate, p_VimListIter);
+  if (!VimList->HasInstance(args.This())) {
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "values(): this is not a VimList")));
+    return;
+  }
+  Handle<Object> self = args.This();
+  Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
+  list_T *list = static_cast<list_T*>(external->Value());
+
+  VimListIter *iter = new VimListIter();
+  tv_set_list(&iter->tv, list);
+  iter->done = false;
+  iter->lw.lw_item = list->lv_first;
+  list_add_watch(list, &iter->lw);
+
+  Handle<Object> obj = VimListIterT->InstanceTemplate()->NewInstance();
+  obj->SetInternalField(0, External::New(isolate, iter));
+  obj->SetInternalField(1, self);
+  iter->handle.Reset(isolate, obj);
+  iter->handle.SetWeak(iter, VimListIterDestroy);
+
+  args.GetReturnValue().Set(obj);
+}
+
+static void
+VimListIterNext(const FunctionCallbackInfo<Value>& args)
+{
+  TRACE("VimListIterNext");
+  Local<FunctionTemplate> VimListIterT = Local<FunctionTemplate>::New(isolate, p_VimListIter);
+  if (!VimListIterT->HasInstance(args.This())) {
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "next(): this is not a VimListIterator")));
+    return;
+  }
+  Handle<External> external = Handle<External>::Cast(args.This()->GetInternalField(0));
+  VimListIter *iter = static_cast<VimListIter*>(external->Value());
+  Handle<Object> result = Object::New(isolate);
+  if (!iter->done && iter->lw.lw_item == NULL)
+    VimListIterFinish(iter);
+  if (iter->done) {
+    result->Set(String::NewFromUtf8(isolate, "value"), Undefined(isolate));
+    result->Set(String::NewFromUtf8(isolate, "done"), True(isolate));
+    args.GetReturnValue().Set(result);
+    return;
+  }
+  listitem_T *li = iter->lw.lw_item;
+  iter->lw.lw_item = li->li_next;
+  std::string err;
+  Handle<Value> v8obj;
+  if (!ItemToV8(li, &li->li_tv, &v8obj, &err)) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+    return;
+  }
+  result->Set(String::NewFromUtf8(isolate, "value"), v8obj);
+  result->Set(String::NewFromUtf8(isolate, "done"), False(isolate));
+  args.GetReturnValue().Set(result);
+}
+
+// iterator[Symbol.iterator]() returns the iterator itself.
+static void
+VimListIterSelf(const FunctionCallbackInfo<Value>& args)
+{
+  args.GetReturnValue().Set(args.This());
+}
+
+static void
+VimListIterFinish(VimListIter *iter)
+{
+  if (iter->done)
+    return;
+  list_rem_watch(iter->tv.vval.v_list, &iter->lw);
+  clear_tv(&iter->tv);
+  iter->done = true;
+}
+
+static void
+VimListIterDestroy(const WeakCallbackData<Object, VimListIter>& data)
+{
+  TRACE("VimListIterDestroy");
+  VimListIter *iter = data.GetParameter();
+  VimListIterFinish(iter);
+  iter->handle.Reset();
+  delete iter;
+}
+
 static dict_T *makedictptr = NULL;
 
 static Handle<Value>
@@ -896,15 +3136,14 @@ MakeVimDict(dict_T *dict)
 }
 
 static void
-VimDictDestroy(const WeakCallbackData<Value, typval_T>& data)
+VimDictDestroy(const WeakCallbackData<Value, listitem_T>& data)
 {
   TRACE("VimDictDestroy");
-  typval_T *tv = data.GetParameter();
+  listitem_T *li = data.GetParameter();
 
-  objcache.del(VimValue(tv->vval.v_dict));
+  objcache.del(VimValue(li->li_tv.vval.v_dict));
 
-  weak_unref(tv);
-  free_tv(tv);
+  release_queue.push_back(li);
 }
 
 static void
@@ -932,61 +3171,83 @@ VimDictCreate(const FunctionCallbackInfo<Value>& args)
   self->SetInternalField(0, External::New(isolate, dict));
 
   // increment Vim's reference count
-  typval_T *tv = alloc_tv();
-  tv_set_dict(tv, dict);
-  weak_ref(tv);
+  typval_T tv;
+  tv_set_dict(&tv, dict);
+  listitem_T *li = pin(&tv);
+  if (li == NULL) {
+    clear_tv(&tv);
+    isolate->ThrowException(String::NewFromUtf8(isolate, "VimDictCreate(): pin(): out of memory"));
+    return;
+  }
 
   // make weak reference
-  CopyableValuePersistent p = CopyableValuePersistent();
-  p.Reset(isolate, self);
-  p.SetWeak(tv, VimDictDestroy);
-  objcache.set(VimValue(dict), p);
+  CopyableValuePersistent *p = objcache.set(VimValue(dict), CopyableValuePersistent());
+  p->Reset(isolate, self);
+  p->SetWeak(li, VimDictDestroy);
 
   args.GetReturnValue().Set(self);
 }
 
+// Integer keys are formatted directly, without making a V8 string first.
+#define INDEX_KEY(buf, index) \
+  char buf[16]; \
+  vim_snprintf(buf, sizeof(buf), (char*)"%u", (unsigned)(index))
+
 static void
 VimDictIdxGet(uint32_t index, const PropertyCallbackInfo<Value>& info)
 {
   TRACE("VimDictIdxGet");
-  VimDictGet(Integer::New(isolate, index)->ToString(), info);
+  INDEX_KEY(key, index);
+  VimDictGetKey((char_u*)key, hash_hash((char_u*)key), Integer::NewFromUnsigned(isolate, index), info);
 }
 
 static void
 VimDictIdxSet(uint32_t index, Local<Value> value, const PropertyCallbackInfo<Value>& info)
 {
   TRACE("VimDictIdxSet");
-  VimDictSet(Integer::New(isolate, index)->ToString(), value, info);
+  typval_T vimobj;
+  if (!VimDictConvert(value, &vimobj))
+    return;
+  INDEX_KEY(key, index);
+  VimDictSetKey((char_u*)key, hash_hash((char_u*)key), &vimobj, value, info);
 }
 
 static void
 VimDictIdxQuery(uint32_t index, const PropertyCallbackInfo<Integer>& info)
 {
   TRACE("VimDictIdxQuery");
-  VimDictQuery(Integer::New(isolate, index)->ToString(), info);
+  INDEX_KEY(key, index);
+  VimDictQueryKey((char_u*)key, hash_hash((char_u*)key), info);
 }
 
 static void
 VimDictIdxDelete(uint32_t index, const PropertyCallbackInfo<Boolean>& info)
 {
   TRACE("VimDictIdxDelete");
-  VimDictDelete(Integer::New(isolate, index)->ToString(), info);
+  INDEX_KEY(key, index);
+  VimDictDeleteKey((char_u*)key, hash_hash((char_u*)key), info);
 }
 
 static void
 VimDictGet(Local<String> property, const PropertyCallbackInfo<Value>& info)
 {
-  TRACE("VimDictIdxGet");
-  Local<FunctionTemplate> VimFunc = Local<FunctionTemplate>::New(isolate, p_VimFunc);
+  TRACE("VimDictGet");
   if (property->Length() == 0) {
     isolate->ThrowException(String::NewFromUtf8(isolate, "Cannot use empty key for Dictionary"));
     return;
   }
+  DictKey *k = LookupDictKey(property);
+  VimDictGetKey((char_u*)k->key.c_str(), k->hash, property, info);
+}
+
+static void
+VimDictGetKey(char_u *key, hash_T hash, Handle<Value> property, const PropertyCallbackInfo<Value>& info)
+{
+  Local<FunctionTemplate> VimFunc = Local<FunctionTemplate>::New(isolate, p_VimFunc);
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   dict_T *dict = static_cast<dict_T*>(external->Value());
-  String::Utf8Value key(property);
-  dictitem_T *di = dict_find(dict, (char_u*)*key, -1);
+  dictitem_T *di = dict_find_hash(dict, key, hash);
   if (di == NULL) {
     // fallback to prototype.  otherwise String(obj) don't work due to
     // lack of toString().
@@ -996,7 +3257,7 @@ VimDictGet(Local<String> property, const PropertyCallbackInfo<Value>& info)
   }
   std::string err;
   Handle<Value> v8obj;
-  if (!vim_to_v8(&di->di_tv, &v8obj, 1, &objcache, &err)) {
+  if (!ItemToV8(di, &di->di_tv, &v8obj, &err)) {
     isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
     return;
   }
@@ -1017,19 +3278,37 @@ VimDictSet(Local<String> property, Local<Value> value, const PropertyCallbackInf
     isolate->ThrowException(String::NewFromUtf8(isolate, "Cannot use empty key for Dictionary"));
     return;
   }
-  Handle<Object> self = info.Holder();
-  Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
-  dict_T *dict = static_cast<dict_T*>(external->Value());
-  String::Utf8Value key(property);
+  // Convert first: v8_to_vim() may read other VimDicts and refill the
+  // DictKey cache.
+  typval_T vimobj;
+  if (!VimDictConvert(value, &vimobj))
+    return;
+  DictKey *k = LookupDictKey(property);
+  VimDictSetKey((char_u*)k->key.c_str(), k->hash, &vimobj, value, info);
+}
+
+static bool
+VimDictConvert(Local<Value> value, typval_T *vimobj)
+{
   V8ToVimLookup lookup;
   std::string err;
-  typval_T vimobj;
-  if (!v8_to_vim(value, &vimobj, 1, &lookup, &err)) {
+  if (!v8_to_vim(value, vimobj, 1, &lookup, &err)) {
     isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
-    return;
+    return false;
   }
-  if (!dict_set_tv_nocopy(dict, (char_u*)*key, &vimobj)) {
-    clear_tv(&vimobj);
+  return true;
+}
+
+// Takes ownership of "vimobj".
+static void
+VimDictSetKey(char_u *key, hash_T hash, typval_T *vimobj, Local<Value> value, const PropertyCallbackInfo<Value>& info)
+{
+  Handle<Object> self = info.Holder();
+  Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
+  dict_T *dict = static_cast<dict_T*>(external->Value());
+  ++string_generation;
+  if (!dict_set_tv_nocopy_hash(dict, key, hash, vimobj)) {
+    clear_tv(vimobj);
     isolate->ThrowException(String::NewFromUtf8(isolate, "error dict_set_tv_nocopy()"));
     return;
   }
@@ -1040,11 +3319,17 @@ static void
 VimDictQuery(Local<String> property, const PropertyCallbackInfo<Integer>& info)
 {
   TRACE("VimDictQuery");
+  DictKey *k = LookupDictKey(property);
+  VimDictQueryKey((char_u*)k->key.c_str(), k->hash, info);
+}
+
+static void
+VimDictQueryKey(char_u *key, hash_T hash, const PropertyCallbackInfo<Integer>& info)
+{
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   dict_T *dict = static_cast<dict_T*>(external->Value());
-  String::Utf8Value key(property);
-  dictitem_T *di = dict_find(dict, (char_u*)*key, -1);
+  dictitem_T *di = dict_find_hash(dict, key, hash);
   if (di == NULL) {
     info.GetReturnValue().Set(Integer::New(isolate, DontEnum));
     return;
@@ -1060,15 +3345,22 @@ VimDictDelete(Local<String> property, const PropertyCallbackInfo<Boolean>& info)
     info.GetReturnValue().Set(False(isolate));
     return;
   }
+  DictKey *k = LookupDictKey(property);
+  VimDictDeleteKey((char_u*)k->key.c_str(), k->hash, info);
+}
+
+static void
+VimDictDeleteKey(char_u *key, hash_T hash, const PropertyCallbackInfo<Boolean>& info)
+{
   Handle<Object> self = info.Holder();
   Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
   dict_T *dict = static_cast<dict_T*>(external->Value());
-  String::Utf8Value key(property);
-  dictitem_T *di = dict_find(dict, (char_u*)*key, -1);
+  dictitem_T *di = dict_find_hash(dict, key, hash);
   if (di == NULL) {
     info.GetReturnValue().Set(False(isolate));
     return;
   }
+  ++string_generation;
   dictitem_remove(dict, di);
   info.GetReturnValue().Set(True(isolate));
 }
@@ -1088,7 +3380,7 @@ VimDictEnumerate(const PropertyCallbackInfo<Array>& info)
   for (hi = ht->ht_array; todo > 0; ++hi) {
     if (!HASHITEM_EMPTY(hi)) {
       --todo;
-      keys->Set(Integer::New(isolate, i++), String::NewFromUtf8(isolate, (char *)hi->hi_key));
+      keys->Set(i++, InternKey(hi->hi_key, hi->hi_hash));
     }
   }
   info.GetReturnValue().Set(keys);
@@ -1104,33 +3396,35 @@ MakeVimFunc(const char *name)
 
   Local<FunctionTemplate> VimFunc = Local<FunctionTemplate>::New(isolate, p_VimFunc);
 
-  typval_T *tv = alloc_tv();
-  tv_set_func(tv, (char_u*)name);
-  weak_ref(tv);
+  typval_T tv;
+  tv_set_func(&tv, (char_u*)name);
+  listitem_T *li = pin(&tv);
+  if (li == NULL) {
+    clear_tv(&tv);
+    return Undefined(isolate);
+  }
 
   Handle<Object> self = VimFunc->InstanceTemplate()->NewInstance();
-  self->SetInternalField(0, External::New(isolate, tv->vval.v_string));
+  self->SetInternalField(0, External::New(isolate, li->li_tv.vval.v_string));
   self->SetInternalField(1, Undefined(isolate));
 
   // make weak reference
-  CopyableValuePersistent p = CopyableValuePersistent();
-  p.Reset(isolate, self);
-  p.SetWeak(tv, VimFuncDestroy);
-  objcache.set(VimValue(tv->vval.v_string), p);
+  CopyableValuePersistent *p = objcache.set(VimValue(li->li_tv.vval.v_string), CopyableValuePersistent());
+  p->Reset(isolate, self);
+  p->SetWeak(li, VimFuncDestroy);
 
   return self;
 }
 
 static void
-VimFuncDestroy(const WeakCallbackData<Value, typval_T>& data)
+VimFuncDestroy(const WeakCallbackData<Value, listitem_T>& data)
 {
   TRACE("VimFuncDestroy");
-  typval_T *tv = data.GetParameter();
+  listitem_T *li = data.GetParameter();
 
-  objcache.del(VimValue(tv->vval.v_string));
+  objcache.del(VimValue(li->li_tv.vval.v_string));
 
-  weak_unref(tv);
-  free_tv(tv);
+  release_queue.push_back(li);
 }
 
 static void
@@ -1143,19 +3437,43 @@ VimFuncCall(const FunctionCallbackInfo<Value>& args)
   }
 
   Handle<Object> self = args.Holder();
+  Handle<External> external = Handle<External>::Cast(self->GetInternalField(0));
+  char_u *name = static_cast<char_u*>(external->Value());
 
-  Handle<Array> arr = Array::New(isolate, args.Length());
-  for (int i = 0; i < args.Length(); ++i)
-    arr->Set(Integer::New(isolate, i), args[i]);
-
-  Handle<Value> obj = self->GetInternalField(1);
+  // Convert the arguments straight into a List for func_call().
+  list_T *list = list_alloc();
+  if (list == NULL) {
+    isolate->ThrowException(String::NewFromUtf8(isolate, "VimFuncCall(): list_alloc(): out of memory"));
+    return;
+  }
+  typval_T argvars;
+  tv_set_list(&argvars, list);
+  V8ToVimLookup lookup;
+  std::string err;
+  for (int i = 0; i < args.Length(); ++i) {
+    typval_T tv;
+    if (!v8_to_vim(args[i], &tv, 1, &lookup, &err)) {
+      clear_tv(&argvars);
+      isolate->ThrowException(String::NewFromUtf8(isolate, err.c_str()));
+      return;
+    }
+    if (!list_append_tv_nocopy(list, &tv)) {
+      clear_tv(&tv);
+      clear_tv(&argvars);
+      isolate->ThrowException(String::NewFromUtf8(isolate, "VimFuncCall(): list_append_tv_nocopy() error"));
+      return;
+    }
+  }
 
-  Handle<Value> callargs[3] = {self, arr, obj};
+  dict_T *selfdict = NULL;
+  typval_T obj;
+  if (v8_to_vim_ref(self->GetInternalField(1), &obj) && obj.v_type == VAR_DICT)
+    selfdict = obj.vval.v_dict;
 
-  // return vim.call(name, args, obj)
-  Local<Context> context = Local<Context>::New(isolate, p_context);
-  Handle<Object> vim = Handle<Object>::Cast(context->Global()->Get(String::NewFromUtf8(isolate, "vim")));
-  Handle<Function> call = Handle<Function>::Cast(vim->Get(String::NewFromUtf8(isolate, "call")));
-  args.GetReturnValue().Set(call->Call(vim, 3, callargs));
+  Handle<Value> result;
+  bool ok = CallVimFunc(name, &argvars, selfdict, &result);
+  clear_tv(&argvars);
+  if (ok)
+    args.GetReturnValue().Set(result);
 }
 
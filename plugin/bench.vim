@@ -0,0 +1,36 @@
+so <sfile>:p:h/init.vim
+so <sfile>:p:h/runner.vim
+
+" usage: :so bench.vim
+" Time per item should stay flat as n grows.
+
+function! s:Report(name, n, start)
+  let t = str2float(reltimestr(reltime(a:start)))
+  echo printf("%s: n=%6d  %8.3fs  %8.2fus/item", a:name, a:n, t, t * 1000000 / a:n)
+endfunction
+
+let s:bench = {}
+
+" bench1: v8 -> vim: array of objects (quickfix entries)
+function s:bench.bench1()
+  for n in [1000, 10000, 50000]
+    execute V8(printf('var data = []; for (var i = 0; i < %d; i++) data.push({lnum: i + 1, col: 1, text: "line " + i});', n))
+    let start = reltime()
+    let x = eval(V8Eval('data'))
+    call s:Report("bench1", n, start)
+  endfor
+  V8 delete data
+endfunction
+
+" bench2: v8 -> vim: array of strings (setline)
+function s:bench.bench2()
+  for n in [1000, 10000, 50000]
+    execute V8(printf('var data = []; for (var i = 0; i < %d; i++) data.push("line " + i);', n))
+    let start = reltime()
+    let x = eval(V8Eval('data'))
+    call s:Report("bench2", n, start)
+  endfor
+  V8 delete data
+endfunction
+
+call V8RunSuite(s:bench)
@@ -5,7 +5,7 @@ command! -nargs=* V8 execute V8(<q-args>, expand('<sfile>') == '')
 
 augroup V8
   au!
-  autocmd CursorHold,CursorHoldI * execute s:lib.v8execute("gc()")
+  autocmd CursorHold,CursorHoldI * call s:lib.idle()
 augroup END
 
 function! V8End()
@@ -19,10 +19,7 @@ endfunction
 " usage:
 "   :let res = eval(V8Eval('3 + 4'))
 function! V8Eval(expr)
-  let result = '"g:__if_v8[''%v8_result%'']"'
-  let jsexpr = 'vim.g["__if_v8"]["%v8_result%"] = eval("(' . escape(a:expr, '\"') . ')")'
-  let expr = s:lib.v8expr(jsexpr)
-  return printf("eval([%s, %s][0])", result, expr)
+  return printf("eval(libcall(\"%s\", 'evaluate', \"%s\"))", escape(s:lib.dll, '\"'), escape(a:expr, '\"'))
 endfunction
 
 
@@ -37,8 +34,28 @@ let s:lib.dir = expand('<sfile>:p:h')
 let s:lib.dll = s:lib.dir . '/if_v8' . (has('win32') ? '.dll' : '.so')
 let s:lib.runtime = [
       \ s:lib.dir . '/runtime.js',
-      \ ]
+      \ ] + map(copy(get(g:, 'if_v8_preload', [])), 'fnamemodify(v:val, ":p")')
 let s:lib.flags = '--expose-gc'
+if exists('g:if_v8_flags')
+  let s:lib.flags .= ' ' . g:if_v8_flags
+endif
+" if_v8 options, one per line, so that a value may contain spaces.
+let s:lib.options = [
+      \ '--if_v8_idle_budget=' . get(g:, 'if_v8_idle_budget', 10),
+      \ '--if_v8_idle_threshold=' . get(g:, 'if_v8_idle_threshold', 1024),
+      \ ]
+for s:opt in ['max_old_space', 'max_semi_space', 'heap_soft_limit']
+  if exists('g:if_v8_' . s:opt)
+    call add(s:lib.options, printf('--if_v8_%s=%d', s:opt, g:if_v8_{s:opt}))
+  endif
+endfor
+unlet! s:opt
+if exists('g:if_v8_code_cache_dir')
+  if !isdirectory(g:if_v8_code_cache_dir)
+    call mkdir(g:if_v8_code_cache_dir, 'p')
+  endif
+  call add(s:lib.options, '--if_v8_code_cache=' . fnamemodify(g:if_v8_code_cache_dir, ':p:s?[/\\]$??'))
+endif
 
 function s:lib.init() abort
   if exists('s:init')
@@ -50,16 +67,18 @@ function s:lib.init() abort
     let path_save = $PATH
     let $PATH .= ';' . self.dir
   endif
-  let err = libcall(self.dll, 'init', self.dll . "," . self.flags)
+  " runtime files are loaded by init() itself
+  let err = libcall(self.dll, 'init', self.dll . "," . join([self.flags] + self.options + self.runtime, "\n"))
   if has('win32')
     let $PATH = path_save
   endif
   if err != ''
     echoerr err
   endif
-  for file in self.runtime
-    call libcall(self.dll, 'execute', printf("load(\"%s\")", escape(file, '\"')))
-  endfor
+endfunction
+
+function s:lib.idle()
+  call libcall(self.dll, 'idle', '')
 endfunction
 
 function s:lib.v8start()
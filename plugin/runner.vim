@@ -0,0 +1,21 @@
+" Helpers shared by test.vim and bench.vim.
+
+function! s:mysort(a, b)
+  let a = matchstr(a:a, '\d\+')
+  let b = matchstr(a:b, '\d\+')
+  return a - b
+endfunction
+
+" Call the functions of {suite} in the numeric order of their names.
+" With {wait}, sleep after each one so that its messages are shown.
+function! V8RunSuite(suite, ...)
+  let wait = get(a:000, 0, 0)
+  for name in sort(keys(a:suite), 's:mysort')
+    echo "\n" . name . "\n"
+    call a:suite[name]()
+    if wait
+      " XXX: message is not shown when more prompt is not fired.
+      sleep 100m
+    endif
+  endfor
+endfunction
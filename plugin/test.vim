@@ -1,4 +1,16 @@
+" preload and code cache in a directory with a space, tested by test33
+let s:preload_dir = tempname() . ' if_v8'
+call mkdir(s:preload_dir, 'p')
+call writefile(['var if_v8_test33 = 33;'], s:preload_dir . '/preload.js')
+let g:if_v8_preload = [s:preload_dir . '/preload.js']
+let g:if_v8_code_cache_dir = s:preload_dir . '/code cache'
+
+let s:dir = expand('<sfile>:p:h')
+
 so <sfile>:p:h/init.vim
+so <sfile>:p:h/runner.vim
+
+unlet g:if_v8_preload g:if_v8_code_cache_dir
 
 function! s:Test(name, expr)
   echo a:name ":" a:expr
@@ -206,17 +218,319 @@ function s:test.test14()
   execute s:Test("test14", "ok")
 endfunction
 
-function! s:mysort(a, b)
-  let a = matchstr(a:a, '\d\+')
-  let b = matchstr(a:b, '\d\+')
-  return a - b
+" test15: wrapper cache
+function s:test.test15()
+  V8Start
+  V8 var n = vim.stats().objcache
+  V8 var x = vim.eval('[[1], [2]]')
+  V8 eval(Test("test15", "x[0] === x[0] && x[1] === x[1]"))
+  V8 eval(Test("test15", "vim.stats().objcache >= n + 3"))
+  V8End
 endfunction
 
-try
-  for s:name in sort(keys(s:test), 's:mysort')
-    echo "\n" . s:name . "\n"
-    call s:test[s:name]()
-    " XXX: message is not shown when more prompt is not fired.
-    sleep 100m
+" test16: VimList indexed access after Vim changes the List
+function s:test.test16()
+  let x = range(10)
+  V8Start
+  V8 var x = vim.eval('x')
+  V8 var sum = 0
+  V8 for (var i = 0; i < x.length; i++) { sum += x[i]; }
+  V8 eval(Test("test16", "sum == 45"))
+  V8 vim.execute('call remove(x, 0) | call insert(x, 100, 3)')
+  V8 eval(Test("test16", "x.length == 10 && x[0] == 1 && x[3] == 100 && x[4] == 4"))
+  V8 delete x[3]
+  V8 eval(Test("test16", "x.length == 9 && x[3] == 4"))
+  V8End
+  execute s:Test("test16", "x == [1, 2, 3, 4, 5, 6, 7, 8, 9]")
+endfunction
+
+" test17: VimList iteration
+function s:test.test17()
+  let x = [1, 2, 3, 4]
+  V8Start
+  V8 var x = vim.eval('x')
+  V8 var a = []
+  V8 x.forEach(function(v, i) { a.push(v * 10 + i); })
+  V8 eval(Test("test17", "a.join() == '10,21,32,43'"))
+  V8 var b = []
+  V8 for (var v of x) { b.push(v); }
+  V8 eval(Test("test17", "b.join() == '1,2,3,4'"))
+  V8 var it = x.values(), c = [], r
+  V8 while (!(r = it.next()).done) { c.push(r.value); if (r.value == 1) vim.execute('call remove(x, 1)'); }
+  V8 eval(Test("test17", "c.join() == '1,3,4'"))
+  V8 eval(Test("test17", "vim.ListToArray(x).length == 3"))
+  V8End
+endfunction
+
+" test18: copy by value
+function s:test.test18()
+  let x = {'a': [1, 2], 'b': {'c': 'd'}}
+  let x.self = x
+  V8Start
+  V8 var y = vim.eval('x', {copy: true})
+  V8 eval(Test("test18", "y instanceof Object && y.a instanceof Array && y.b.c == 'd' && y.self === y"))
+  V8 y.a.push(3)
+  V8 var z = vim.ListToArray(vim.eval('x.a'))
+  V8 eval(Test("test18", "z instanceof Array && z.length == 2"))
+  V8 var w = vim.DictToObject(vim.eval('x'))
+  V8 eval(Test("test18", "w.a instanceof vim.List"))
+  V8End
+  execute s:Test("test18", "len(x.a) == 2")
+endfunction
+
+" test19: typed arrays
+function s:test.test19()
+  let x = [1, 2.5, -3]
+  V8Start
+  V8 var f = vim.toFloat64Array(vim.eval('x'))
+  V8 eval(Test("test19", "f instanceof Float64Array && f.length == 3 && f[1] == 2.5"))
+  V8 var i = vim.toInt32Array(vim.eval('x'))
+  V8 eval(Test("test19", "i instanceof Int32Array && i[1] == 2 && i[2] == -3"))
+  V8 var l = vim.fromTypedArray(new Int32Array([4, 5, 6]))
+  V8End
+  let l = eval(V8Eval('l'))
+  execute s:Test("test19", "l == [4, 5, 6]")
+  let y = eval(V8Eval('new Float64Array([0.5, 1.5])'))
+  execute s:Test("test19", "y == [0.5, 1.5]")
+endfunction
+
+" test20: large strings
+function s:test.test20()
+  let x = repeat('abcdefgh', 1024)
+  let y = repeat("\u3042", 4096)
+  V8Start
+  V8 var x = vim.eval('x'), y = vim.eval('y')
+  V8 eval(Test("test20", "x.length == 8192 && x.substr(8, 8) == 'abcdefgh'"))
+  V8 eval(Test("test20", "y.length == 4096 && y.charCodeAt(0) == 0x3042"))
+  V8End
+  execute s:Test("test20", "eval(V8Eval('x')) ==# x && eval(V8Eval('y')) ==# y")
+endfunction
+
+" test21: VimDict keys
+function s:test.test21()
+  let x = {'foo': 1, 'bar': 2, '3': 'three'}
+  V8Start
+  V8 var x = vim.eval('x'), keys = []
+  V8 for (var k in x) { keys.push(k); }
+  V8 eval(Test("test21", "keys.sort().join() == '3,bar,foo'"))
+  V8 var sum = 0
+  V8 for (var i = 0; i < 100; i++) { sum += x.foo + x['bar']; }
+  V8 eval(Test("test21", "sum == 300 && x[3] == 'three' && ('foo' in x) && !('baz' in x)"))
+  V8 x.baz = x.foo; x[4] = 'four'; delete x.bar
+  V8End
+  execute s:Test("test21", "x == {'foo': 1, 'baz': 1, '3': 'three', '4': 'four'}")
+endfunction
+
+" test22: JS strings to Vim
+function s:test.test22()
+  let x = {}
+  V8Start
+  V8 var x = vim.eval('x')
+  V8 x.ascii = 'abc'; x.mixed = 'a\u3042b'; x.date = new Date(0); x.empty = ''
+  V8End
+  execute s:Test("test22", "x.ascii ==# 'abc' && x.mixed ==# \"a\\u3042b\" && x.empty ==# ''")
+  execute s:Test("test22", "type(x.date) == type('') && x.date != ''")
+endfunction
+
+" test23: call Vim function
+function s:test.test23()
+  let x = {'n': 2}
+  function x.mul(a) dict
+    return self.n * a:a
+  endfunction
+  V8Start
+  V8 var x = vim.eval('x')
+  V8 eval(Test("test23", "vim.getline(1) === vim.call('getline', [1]) && x.mul(21) == 42"))
+  V8 eval(Test("test23", "vim.call(x.mul, [3], {n: 5}) == 15"))
+  V8 var e = ''; try { vim.call('NoSuchFunction', []); } catch (ex) { e = String(ex); }
+  V8 eval(Test("test23", "/^Vim/.test(e)"))
+  V8End
+endfunction
+
+" test24: native vim.eval
+function s:test.test24()
+  V8Start
+  V8 var sum = 0; for (var i = 0; i < 100; i++) { sum += vim.eval('1 + 1'); }
+  V8 eval(Test("test24", "sum == 200 && vim.eval('&tw') === vim.call('eval', ['&tw'])"))
+  V8 var e = ''; try { vim.eval('1 +'); } catch (ex) { e = String(ex); }
+  V8 eval(Test("test24", "/^Vim/.test(e)"))
+  V8 e = ''; try { vim.eval('no_such_variable'); } catch (ex) { e = String(ex); }
+  V8 eval(Test("test24", "/E121/.test(e)"))
+  V8End
+endfunction
+
+" test25: vim.execute errors
+function s:test.test25()
+  V8Start
+  V8 var e = ''; try { vim.execute('throw "foo"'); } catch (ex) { e = String(ex); }
+  V8 eval(Test("test25", "e == 'foo'"))
+  V8 e = ''; try { vim.execute('call NoSuchFunction()'); } catch (ex) { e = String(ex); }
+  V8 eval(Test("test25", "/E117/.test(e)"))
+  V8 vim.let('g:if_v8_test25', [1, 2])
+  V8 vim.let('g:if_v8_test25b', {'a': 1}); vim.let('g:if_v8_test25b.b', 2)
+  V8 e = ''; try { vim.let('v:count', 1); } catch (ex) { e = String(ex); }
+  V8 eval(Test("test25", "/E46/.test(e)"))
+  V8End
+  execute s:Test("test25", "g:if_v8_test25 == [1, 2] && g:if_v8_test25b == {'a': 1, 'b': 2} && !has_key(g:__if_v8, '%v8_value%')")
+  unlet g:if_v8_test25 g:if_v8_test25b
+endfunction
+
+" test26: vim.batch
+function s:test.test26()
+  V8Start
+  V8 var r = vim.batch([{let: ['g:if_v8_test26', 2]}, {eval: 'g:if_v8_test26 * 3'}, {cmd: 'unlet g:if_v8_test26'}, {eval: '1 +'}, {eval: '[1]', copy: true}])
+  V8 eval(Test("test26", "r.length == 5 && r[0] === undefined && r[1] == 6 && r[3] instanceof Error && r[4] instanceof Array"))
+  V8 r = vim.batch([{cmd: 'throw "x"'}, {eval: '1'}], {stopOnError: true})
+  V8 eval(Test("test26", "r.length == 1 && r[0].message == 'x'"))
+  V8End
+  execute s:Test("test26", "!exists('g:if_v8_test26')")
+endfunction
+
+" test27: lazy builtin functions
+function s:test.test27()
+  V8Start
+  V8 eval(Test("test27", "vim.tolower === vim.tolower && vim.tolower('ABC') == 'abc'"))
+  V8 eval(Test("test27", "Object.keys(vim).indexOf('writefile') != -1 && vim._delete === vim['delete']"))
+  V8 var save = vim.toupper; vim.toupper = function() { return 'x'; }
+  V8 eval(Test("test27", "vim.toupper('a') == 'x'"))
+  V8 vim.toupper = save
+  V8End
+endfunction
+
+" test28: compiled script cache
+function s:test.test28()
+  V8 var if_v8_test28 = vim.stats()
+  for i in range(3)
+    V8 if_v8_test28_n = (typeof if_v8_test28_n == 'number') ? if_v8_test28_n + 1 : 1
   endfor
+  V8 eval(Test("test28", "if_v8_test28_n == 3 && vim.stats().scriptcache_hits >= if_v8_test28.scriptcache_hits + 2"))
+endfunction
+
+" test29: require
+function s:test.test29()
+  let dir = tempname()
+  call mkdir(dir)
+  call writefile(['var b = require("./b");', 'exports.value = b.value + 1;'], dir . '/a.js')
+  call writefile(['exports.value = 1;'], dir . '/b.js')
+  let g:if_v8_test29 = dir
+  V8Start
+  V8 var a = require(vim.g.if_v8_test29 + '/a')
+  V8 eval(Test("test29", "a.value == 2 && require(vim.g.if_v8_test29 + '/a.js') === a"))
+  V8End
+  call writefile(['exports.value = 10;'], dir . '/b.js')
+  V8 eval(Test("test29", "require(vim.g.if_v8_test29 + '/b').value == 10"))
+  V8 var e = ''; try { require('./no_such_module'); } catch (ex) { e = ex.message; }
+  V8 eval(Test("test29", "/Cannot find module/.test(e)"))
+  call delete(dir . '/a.js')
+  call delete(dir . '/b.js')
+  unlet g:if_v8_test29
+endfunction
+
+" test30: V8Eval result types
+function s:test.test30()
+  let x = eval(V8Eval('0.1 + 0.2'))
+  execute s:Test("test30", "type(x) == type(0.0) && x == 0.1 + 0.2")
+  let y = eval(V8Eval('1e300'))
+  execute s:Test("test30", "y == 1.0e300")
+  let z = eval(V8Eval('-1.5e308'))
+  execute s:Test("test30", "z == -1.5e308 && string(z) !~ 'inf'")
+  let w = eval(V8Eval('-Infinity'))
+  execute s:Test("test30", "string(w) ==# '-inf'")
+  let s = eval(V8Eval('"it''s"'))
+  execute s:Test("test30", "s ==# \"it's\"")
+  let d = eval(V8Eval('{a: [1, "b"]}'))
+  execute s:Test("test30", "d == {'a': [1, 'b']}")
+endfunction
+
+" test31: heap statistics
+function s:test.test31()
+  V8 var h = vim.heapStatistics()
+  V8 eval(Test("test31", "h.used_heap_size > 0 && h.heap_soft_limit < h.heap_size_limit"))
+endfunction
+
+" test32: shared and distinct objects in a large Array: v8 -> vim
+function s:test.test32()
+  V8 var o = {a: 1}; var if_v8_test32 = []; for (var i = 0; i < 10000; i++) { if_v8_test32.push(i % 2 ? o : {a: i}); }
+  let x = eval(V8Eval('if_v8_test32'))
+  execute s:Test("test32", "len(x) == 10000 && x[1] is x[9999] && x[0] isnot x[2] && x[2].a == 2")
+  V8 delete if_v8_test32
+endfunction
+
+" test33: g:if_v8_preload and a code cache directory with a space
+function s:test.test33()
+  V8 eval(Test("test33", "if_v8_test33 == 33"))
+  let file = resolve(s:preload_dir . '/preload.js')
+  execute s:Test("test33", "filereadable(s:preload_dir . '/code cache/' . substitute(file, '[/\\\\:]', '%', 'g') . '.cache')")
+  V8 eval(Test("test33", "vim.stats().codecache_hits + vim.stats().codecache_misses >= 2"))
+endfunction
+
+" test34: collected wrappers return their bookkeeping to the pools
+function s:test.test34()
+  V8 for (var i = 0; i < 1000; i++) { var if_v8_test34 = vim.eval('[1, 2]'); if_v8_test34[0] + if_v8_test34[1]; }
+  V8 gc()
+  let n = 0
+  while n < 20 && eval(V8Eval('vim.stats().release_queue')) > 0
+    let n += 1
+  endwhile
+  V8 var if_v8_test34 = vim.stats()
+  V8 eval(Test("test34", "if_v8_test34.pool >= 999 && if_v8_test34.release_queue == 0"))
+  V8 for (var i = 0; i < 1000; i++) { var l = vim.eval('[1, 2]'); l[0] + l[1]; }
+  V8 eval(Test("test34", "vim.stats().pool_hits >= if_v8_test34.pool_hits + 1000"))
+  V8 delete if_v8_test34
+endfunction
+
+" test35: the release queue of many collected wrappers is drained
+function s:test.test35()
+  V8 for (var i = 0; i < 10000; i++) { vim.eval('[1]'); }
+  V8 gc()
+  V8 var if_v8_test35 = vim.stats().release_queue
+  V8 eval(Test("test35", "if_v8_test35 > 0 && vim.stats().release_queue < if_v8_test35"))
+  let n = 0
+  while n < 20 && eval(V8Eval('vim.stats().release_queue')) > 0
+    let n += 1
+  endwhile
+  execute s:Test("test35", "n < 20")
+endfunction
+
+" test36: a script exceeding the heap soft limit is terminated
+" Runs in its own Vim, since the heap of a terminated script stays large.
+function s:test.test36()
+  let script = tempname()
+  let out = tempname()
+  let alloc = '(function () { var a = []; while (true) { a.push([a.length]); } })()'
+  call writefile([
+        \ 'let g:if_v8_heap_soft_limit = 16',
+        \ 'source ' . fnameescape(s:dir . '/init.vim'),
+        \ 'let r = []',
+        \ 'try',
+        \ '  V8 ' . alloc,
+        \ '  call add(r, "not terminated")',
+        \ 'catch',
+        \ '  call add(r, v:exception =~# "heap limit reached" ? "terminated" : v:exception)',
+        \ 'endtry',
+        \ 'try',
+        \ '  V8 var if_v8_test36 = 36',
+        \ '  call add(r, eval(V8Eval("if_v8_test36")) == 36 ? "continued" : "wrong value")',
+        \ 'catch',
+        \ '  call add(r, v:exception)',
+        \ 'endtry',
+        \ 'let v:errmsg = ""',
+        \ 'let x = -1',
+        \ 'silent! let x = eval(V8Eval(' . string(alloc) . '))',
+        \ 'call add(r, type(x) == type(0) && x == 0 && v:errmsg =~# "heap limit reached" ? "evaluated" : string(x) . v:errmsg)',
+        \ 'call writefile(r, ' . string(out) . ')',
+        \ 'qall!',
+        \ ], script)
+  let prog = exists('v:progpath') ? v:progpath : v:progname
+  call system(printf('%s -u %s -i NONE -N -es --noplugin', shellescape(prog), shellescape(script)))
+  let r = filereadable(out) ? readfile(out) : []
+  call delete(script)
+  call delete(out)
+  execute s:Test("test36", "r == ['terminated', 'continued', 'evaluated']")
+endfunction
+
+try
+  call V8RunSuite(s:test, 1)
+finally
+  call delete(s:preload_dir, 'rf')
 endtry
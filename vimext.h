@@ -21,6 +21,9 @@
 #define FALSE 0
 #define TRUE 1
 
+#define OK 1
+#define FAIL 0
+
 #define STRLEN(s)	    strlen((char *)(s))
 #define STRCPY(d, s)	    strcpy((char *)(d), (char *)(s))
 
@@ -223,6 +226,39 @@ static dictitem_T dumdi;
 
 struct condstack;
 
+typedef long linenr_T;		/* line number type */
+
+/*
+ * A list of error messages that can be converted to an exception.
+ */
+struct msglist
+{
+    char_u		*msg;		/* original message */
+    char_u		*throw_msg;	/* msg to throw: usually original one */
+    struct msglist	*next;		/* next of several messages in a row */
+};
+
+/*
+ * Structure describing an exception.
+ */
+typedef struct vim_exception except_T;
+struct vim_exception
+{
+    int			type;		/* exception type */
+    char_u		*value;		/* exception value */
+    struct msglist	*messages;	/* message(s) causing error exception */
+    char_u		*throw_name;	/* name of the throw point */
+    linenr_T		throw_lnum;	/* line number of the throw point */
+    except_T		*caught;	/* next exception on the caught stack */
+};
+
+/*
+ * The exception types.
+ */
+#define ET_USER		0	/* exception caused by ":throw" command */
+#define ET_ERROR	1	/* error exception */
+#define ET_INTERRUPT	2	/* interrupt exception triggered by Ctrl-C */
+
 /* functions {{{1 */
 static const char *init_vim();
 /* typval */
@@ -232,6 +268,8 @@ static listitem_T *listitem_alloc();
 static void listitem_free(listitem_T *item);
 static listitem_T *list_find(list_T *l, long n);
 static void list_append(list_T *l, listitem_T *item);
+static void list_add_watch(list_T *l, listwatch_T *lw);
+static void list_rem_watch(list_T *l, listwatch_T *lwrem);
 static void list_fix_watch(list_T *l, listitem_T *item);
 static void list_remove(list_T *l, listitem_T *item, listitem_T *item2);
 static long list_len(list_T *l);
@@ -252,10 +290,13 @@ static void tv_set_number(typval_T *tv, varnumber_T number);
 static void tv_set_float(typval_T *tv, float_T v_float);
 #endif
 static void tv_set_string(typval_T *tv, char_u *string);
+static void tv_set_string_nocopy(typval_T *tv, char_u *string);
 static void tv_set_list(typval_T *tv, list_T *list);
 static void tv_set_dict(typval_T *tv, dict_T *dict);
 static void tv_set_func(typval_T *tv, char_u *name);
 static int dict_set_tv_nocopy(dict_T *dict, char_u *key, typval_T *tv);
+static dictitem_T *dict_find_hash(dict_T *d, char_u *key, hash_T hash);
+static int dict_set_tv_nocopy_hash(dict_T *dict, char_u *key, hash_T hash, typval_T *tv);
 static int list_append_tv_nocopy(list_T *list, typval_T *tv);
 
 /* import {{{1 */
@@ -266,6 +307,11 @@ extern "C" {
 /* variables */
 DLLIMPORT char_u hash_removed;
 DLLIMPORT int got_int;
+DLLIMPORT int did_emsg;
+DLLIMPORT int trylevel;
+DLLIMPORT int did_throw;
+DLLIMPORT except_T *current_exception;
+DLLIMPORT struct msglist **msg_list;
 /* functions */
 DLLIMPORT typval_T *eval_expr(char_u *arg, char_u **nextcmd);
 DLLIMPORT int do_cmdline_cmd(char_u *cmd);
@@ -283,9 +329,17 @@ DLLIMPORT void list_free(list_T *l, int recurse);
 DLLIMPORT dict_T *dict_alloc();
 DLLIMPORT int hash_add(hashtab_T *ht, char_u *key);
 DLLIMPORT hashitem_T *hash_find(hashtab_T *ht, char_u *key);
+DLLIMPORT hashitem_T *hash_lookup(hashtab_T *ht, char_u *key, hash_T hash);
+DLLIMPORT int hash_add_item(hashtab_T *ht, hashitem_T *hi, char_u *key, hash_T hash);
+DLLIMPORT hash_T hash_hash(char_u *key);
 DLLIMPORT void hash_remove(hashtab_T *ht, hashitem_T *hi);
 DLLIMPORT int vim_snprintf(char *str, size_t str_m, char *fmt, ...);
 DLLIMPORT void ui_breakcheck();
+DLLIMPORT int func_call(char_u *name, typval_T *args, dict_T *selfdict, typval_T *rettv);
+DLLIMPORT void discard_current_exception();
+DLLIMPORT char_u *get_exception_string(void *value, int type, char_u *cmdname, int *should_free);
+DLLIMPORT void free_global_msglist();
+DLLIMPORT void set_var(char_u *name, typval_T *tv, int copy);
 #ifdef __cplusplus
 }
 #endif
@@ -464,6 +518,43 @@ list_append(
     item->li_next = NULL;
 }
 
+/*
+ * Add a watcher to a list.
+ */
+    static void
+list_add_watch(
+    list_T	*l,
+    listwatch_T	*lw
+    )
+{
+    lw->lw_next = l->lv_watch;
+    l->lv_watch = lw;
+}
+
+/*
+ * Remove a watcher from a list.
+ * No warning when it isn't found...
+ */
+    static void
+list_rem_watch(
+    list_T	*l,
+    listwatch_T	*lwrem
+    )
+{
+    listwatch_T	*lw, **lwp;
+
+    lwp = &l->lv_watch;
+    for (lw = l->lv_watch; lw != NULL; lw = lw->lw_next)
+    {
+	if (lw == lwrem)
+	{
+	    *lwp = lw->lw_next;
+	    break;
+	}
+	lwp = &lw->lw_next;
+    }
+}
+
 /*
  * Just before removing an item from a list: advance watchers to the next
  * item.
@@ -712,6 +803,14 @@ tv_set_string(typval_T *tv, char_u *string)
     tv->vval.v_string = vim_strsave(string);
 }
 
+static void
+tv_set_string_nocopy(typval_T *tv, char_u *string)
+{
+    tv->v_type = VAR_STRING;
+    tv->v_lock = 0;
+    tv->vval.v_string = string;
+}
+
 static void
 tv_set_list(typval_T *tv, list_T *list)
 {
@@ -765,6 +864,50 @@ dict_set_tv_nocopy(dict_T *dict, char_u *key, typval_T *tv)
     return TRUE;
 }
 
+/*
+ * dict_find() with a precomputed hash_hash() of "key".
+ */
+static dictitem_T *
+dict_find_hash(dict_T *d, char_u *key, hash_T hash)
+{
+    hashitem_T *hi;
+
+    hi = hash_lookup(&d->dv_hashtab, key, hash);
+    if (HASHITEM_EMPTY(hi))
+	return NULL;
+    return HI2DI(hi);
+}
+
+/*
+ * dict_set_tv_nocopy() with a precomputed hash_hash() of "key".
+ */
+static int
+dict_set_tv_nocopy_hash(dict_T *dict, char_u *key, hash_T hash, typval_T *tv)
+{
+    hashitem_T *hi;
+    dictitem_T *di;
+
+    hi = hash_lookup(&dict->dv_hashtab, key, hash);
+    if (HASHITEM_EMPTY(hi))
+    {
+	di = dictitem_alloc(key);
+	if (di == NULL)
+	    return FALSE;
+	if (!hash_add_item(&dict->dv_hashtab, hi, di->di_key, hash))
+	{
+	    vim_free(di);
+	    return FALSE;
+	}
+    }
+    else
+    {
+	di = HI2DI(hi);
+	clear_tv(&di->di_tv);
+    }
+    di->di_tv = *tv;
+    return TRUE;
+}
+
 static int
 list_append_tv_nocopy(list_T *list, typval_T *tv)
 {